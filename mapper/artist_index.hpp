@@ -5,11 +5,16 @@
 #include <map>
 #include <cassert>
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 
 #include <cereal/archives/binary.hpp>
 #include "libpq-fe.h"
 #include "SQLiteCpp.h"
 #include "fuzzy_index.hpp"
+#include "pg_extract.hpp"
 #include "encode.hpp"
 #include "utils.hpp"
 
@@ -18,6 +23,10 @@ using namespace std;
 const int SINGLE_ARTIST_INDEX_ENTITY_ID = -1;
 const int MULTIPLE_ARTIST_INDEX_ENTITY_ID = -2;
 const int STUPID_ARTIST_INDEX_ENTITY_ID = -3;
+// The vocabulary and idf shared by recording and release indexes, see RecordingIndex::use_global_vocabulary()
+const int GLOBAL_VOCABULARY_ENTITY_ID = -4;
+// Its blob starts with this and the vocabulary's fingerprint, which the indexes built with it store too
+const uint32_t GLOBAL_VOCABULARY_BLOB_MAGIC = 0x4256464c;    // "LFVB"
 
 // Fetch artist names for artist credits with artist_count = 1
 const char *fetch_single_artists_query = R"(
@@ -100,56 +109,42 @@ const char *fetch_blob_query =
 #include <algorithm> // For std::remove_if
 #include <libpq-fe.h> // The C API header
 
-vector<string> parse_pg_array(const char* array_str) {
-    if (!array_str || array_str[0] != '{') {
-        return {}; // Return empty vector if not a valid array string
-    }
-
-    vector<string> elements;
-    string raw(array_str);
-    
-    // Remove the surrounding braces: { and }
-    raw.erase(0, 1);
-    if (!raw.empty() && raw.back() == '}') {
-        raw.pop_back();
-    }
-
-    string current_element;
-    bool inside_quotes = false;
-    
-    for (size_t i = 0; i < raw.length(); ++i) {
-        char c = raw[i];
-
-        if (c == '"') {
-            // If the next character is also a quote, it's an escaped quote ("")
-            if (i + 1 < raw.length() && raw[i+1] == '"') {
-                current_element += '"';
-                i++; // Skip the next quote
-            } else {
-                // Toggle quote state for opening/closing quotes, but don't add the quote character
-                inside_quotes = !inside_quotes;
-            }
-        } else if (c == ',' && !inside_quotes) {
-            // Element separator outside of quotes
-            elements.push_back(current_element);
-            current_element.clear();
-        } else {
-            // Regular character
-            current_element += c;
+// Lets index builds run at the same time for as long as their estimated memory fits in a budget. A build
+// that doesn't fit waits for running ones to finish, but one build always runs even if it alone is over.
+class MemoryBudget {
+    private:
+        size_t                                    limit, used;     // in MB, a limit of 0 means no limit
+        mutex                                     budget_mutex;
+        condition_variable                        released;
+
+    public:
+        MemoryBudget(size_t _limit) : limit(_limit), used(0) {
         }
-    }
 
-    if (!current_element.empty() || raw.empty()) {
-        elements.push_back(current_element);
-    }
+        void
+        acquire(size_t size) {
+            unique_lock<mutex> lock(budget_mutex);
+            released.wait(lock, [&]() { return limit == 0 || used == 0 || used + size <= limit; });
+            used += size;
+        }
 
-    return elements;
-}
+        void
+        release(size_t size) {
+            {
+                lock_guard<mutex> lock(budget_mutex);
+                used -= size;
+            }
+            released.notify_all();
+        }
+};
 
 class ArtistIndex {
     private:
-        string                                    index_dir, db_file; 
+        string                                    index_dir;
         EncodeSearchData                          encode;
+        int                                       weight_format;
+        unsigned int                              num_threads;     // for vectorising the texts
+        size_t                                    build_memory;    // MB the index builds may use together, 0 for no limit
 
         // Single artist index
         vector<unsigned int>                      single_artist_credit_ids;
@@ -162,9 +157,12 @@ class ArtistIndex {
     public:
         FuzzyIndex                               *single_artist_index, *multiple_artist_index, *stupid_artist_index;
 
-        ArtistIndex(const string &_index_dir) {
+        ArtistIndex(const string &_index_dir, int _weight_format = WEIGHT_FORMAT_FLOAT, unsigned int _num_threads = 1,
+                    size_t _build_memory = 0) {
             index_dir = _index_dir;
-            db_file = _index_dir + string("/mapping.db");
+            weight_format = _weight_format;
+            num_threads = _num_threads;
+            build_memory = _build_memory;
             single_artist_index = nullptr;
             multiple_artist_index = nullptr;
             stupid_artist_index = nullptr;
@@ -317,36 +315,14 @@ class ArtistIndex {
         load_artist_data(const char *query, vector<unsigned int> &ids, vector<string> &texts) {
             try
             {
-                PGconn     *conn;
-                PGresult   *res;
-                
-                const char* db_connect = std::getenv("CANONICAL_MUSICBRAINZ_DATA_CONNECT");
-                if (!db_connect || strlen(db_connect) == 0) {
-                    throw std::runtime_error("CANONICAL_MUSICBRAINZ_DATA_CONNECT environment variable not set");
-                }
-                conn = PQconnectdb(db_connect);
-                if (PQstatus(conn) != CONNECTION_OK) {
-                    log("Connection to database failed: %s", PQerrorMessage(conn));
-                    PQfinish(conn);
-                    throw std::runtime_error("PostgreSQL connection failed");
-                }
-               
-                res = PQexec(conn, query);
-                if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-                    std::string error_msg = "Query failed: " + std::string(PQerrorMessage(conn));
-                    PQclear(res);
-                    PQfinish(conn);
-                    throw std::runtime_error(error_msg);
-                }
-
-                for (int i = 0; i < PQntuples(res) + 1; i++) {
-                    if (i >= PQntuples(res)) 
-                        break;
+                PGRowStream    rows(query);
+                vector<string> artist_credit_names, join_phrases;
 
-                    unsigned int artist_credit_id = atoi(PQgetvalue(res, i, 0));
-                    string artist_credit_name = PQgetvalue(res, i, 1);
-                    vector<string> artist_credit_names = parse_pg_array(PQgetvalue(res, i, 2));
-                    vector<string> join_phrases = parse_pg_array(PQgetvalue(res, i, 3));
+                while (rows.next()) {
+                    unsigned int artist_credit_id = atoi(rows.value(0));
+                    string artist_credit_name = rows.value(1);
+                    parse_pg_array(rows.value(2), artist_credit_names);
+                    parse_pg_array(rows.value(3), join_phrases);
 
                     ids.push_back(artist_credit_id);
                     texts.push_back(artist_credit_name);
@@ -376,9 +352,6 @@ class ArtistIndex {
                         texts.push_back(artist_credit_sort_name);
                     }
                 }
-            
-                // Clear the PGresult object to free memory
-                PQclear(res);
             }
             catch (exception& e)
             {
@@ -390,33 +363,13 @@ class ArtistIndex {
         load_artist_aliases(vector<unsigned int> &ids, vector<string> &texts) {
             try
             {
-                PGconn     *conn;
-                PGresult   *res;
-                
-                const char* db_connect = std::getenv("CANONICAL_MUSICBRAINZ_DATA_CONNECT");
-                if (!db_connect || strlen(db_connect) == 0) {
-                    throw std::runtime_error("CANONICAL_MUSICBRAINZ_DATA_CONNECT environment variable not set");
-                }
-                conn = PQconnectdb(db_connect);
-                if (PQstatus(conn) != CONNECTION_OK) {
-                    log("Connection to database failed: %s", PQerrorMessage(conn));
-                    PQfinish(conn);
-                    throw std::runtime_error("PostgreSQL connection failed");
-                }
-               
-                res = PQexec(conn, fetch_artist_aliases_query);
-                if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-                    std::string error_msg = "Query failed: " + std::string(PQerrorMessage(conn));
-                    PQclear(res);
-                    PQfinish(conn);
-                    throw std::runtime_error(error_msg);
-                }
-
+                PGRowStream rows(fetch_artist_aliases_query);
                 map<unsigned int, set<string>> alias_groups;
-                for (int i = 0; i < PQntuples(res); i++) {
-                    unsigned int artist_credit_id = atoi(PQgetvalue(res, i, 0));
+                string encoded;
+                while (rows.next()) {
+                    unsigned int artist_credit_id = atoi(rows.value(0));
                     
-                    string encoded = encode.encode_string(PQgetvalue(res, i, 1));
+                    encode.encode_string(string_view(rows.value(1), rows.length(1)), encoded);
                     if (encoded.size())
                         alias_groups[artist_credit_id].insert(encoded);
                 }
@@ -430,10 +383,6 @@ class ArtistIndex {
                         texts.push_back(it);
                     }
                 }
-            
-                // Clear the PGresult object to free memory
-                PQclear(res);
-                PQfinish(conn);
             }
             catch (exception& e)
             {
@@ -441,20 +390,22 @@ class ArtistIndex {
             }
         }
         
-        void build() {
-            
+        // Load and encode the single artist data, sorting the names that encode to nothing into stupid_artist_data
+        void
+        load_single_artists(set<pair<unsigned int, string>> &unique_artist_data,
+                            set<pair<unsigned int, string>> &stupid_artist_data) {
             log("load single artist data");
+            // The aliases come from a query of their own, on a connection of their own
+            vector<unsigned int> alias_ids;
+            vector<string>       alias_texts;
+            thread alias_loader([&]() { load_artist_aliases(alias_ids, alias_texts); });
             // TODO: THis process creates duplicates
             load_artist_data(fetch_single_artists_query, single_artist_credit_ids, single_artist_credit_texts);
-            load_artist_aliases(single_artist_credit_ids, single_artist_credit_texts);
-            
-            set<pair<unsigned int, string>> unique_artist_data, stupid_artist_data;
-
-            vector<unsigned int> single_ids, multiple_ids, stupid_ids;
-            vector<string>       single_texts, multiple_texts, stupid_texts; 
-            
-            // TESTING:
-            // - Leave out stupid artists for now.
+            alias_loader.join();
+            single_artist_credit_ids.insert(single_artist_credit_ids.end(), alias_ids.begin(), alias_ids.end());
+            single_artist_credit_texts.insert(single_artist_credit_texts.end(), alias_texts.begin(), alias_texts.end());
+            vector<unsigned int>().swap(alias_ids);
+            vector<string>().swap(alias_texts);
 
             log("encode and unique artist data");
             // Encode the single artists into sets in order to remove dups
@@ -471,92 +422,18 @@ class ArtistIndex {
             }
             vector<unsigned int>().swap(single_artist_credit_ids);
             vector<string>().swap(single_artist_credit_texts);
-            
-            // Convert sets back to vectors for insertion into fuzzyindex
-            for(auto &it : unique_artist_data) {
-                single_ids.push_back(it.first);
-                single_texts.push_back(it.second);
-            }
-            set<pair<unsigned int, string>>().swap(unique_artist_data);
-
-            for(auto &it : stupid_artist_data) {
-                stupid_ids.push_back(it.first);
-                stupid_texts.push_back(it.second);
-            }
-            set<pair<unsigned int, string>>().swap(stupid_artist_data);
-
-            // The extra contexts are so that the stringstreams go out of scope ASAP
-            {
-                FuzzyIndex *single_artist_index = new FuzzyIndex();
-                log("build single artist index");
-                single_artist_index->build(single_ids, single_texts);
-                std::stringstream ss_single;
-                {
-                    cereal::BinaryOutputArchive oarchive(ss_single);
-                    oarchive(*single_artist_index);
-                }
-                delete single_artist_index;
-                vector<unsigned int>().swap(single_ids);
-                vector<string>().swap(single_texts);
+        }
 
-                log("artist index size: %lu bytes", ss_single.str().length());
-                try
-                {
-                    SQLite::Database    db(db_file, SQLite::OPEN_READWRITE);
-                    SQLite::Statement   query(db, insert_blob_query);
-                
-                    log("save single artist index");
-                    query.bind(1, SINGLE_ARTIST_INDEX_ENTITY_ID);
-                    query.bind(2, (const char *)ss_single.str().c_str(), (int32_t)ss_single.str().length());
-                    query.exec();
-                }
-                catch (std::exception& e)
-                {
-                    printf("save single artist index db exception: %s\n", e.what());
-                }
-            }
-      
-            {
-                std::stringstream ss_stupid;
-                if (stupid_ids.size()) {
-                    FuzzyIndex *stupid_artist_index = new FuzzyIndex();
-                    log("build stupid artist index");
-                    stupid_artist_index->build(stupid_ids, stupid_texts);
-                    {
-                        cereal::BinaryOutputArchive oarchive(ss_stupid);
-                        oarchive(*stupid_artist_index);
-                    }
-                    log("stupid artist index size: %lu bytes", ss_stupid.str().length());
-                    delete stupid_artist_index;
-
-                    if (stupid_ids.size()) {
-                        try
-                        {
-                            SQLite::Database    db(db_file, SQLite::OPEN_READWRITE);
-                            SQLite::Statement   query(db, insert_blob_query);
-                        
-                            SQLite::Statement   query2(db, insert_blob_query);
-                            log("save stupid artist index");
-                            query2.bind(1, STUPID_ARTIST_INDEX_ENTITY_ID);
-                            query2.bind(2, (const char *)ss_stupid.str().c_str(), (int32_t)ss_stupid.str().length());
-                            query2.exec();
-                        }
-                        catch (std::exception& e)
-                        {
-                            printf("save stupid artist index db exception: %s\n", e.what());
-                        }
-                    }
-                    vector<unsigned int>().swap(stupid_ids);
-                    vector<string>().swap(stupid_texts);
-                }
-            }
+        // Runs alongside load_single_artists() in build(), so it encodes with an encoder of its own
+        void
+        load_multiple_artists(vector<unsigned int> &multiple_ids, vector<string> &multiple_texts) {
+            EncodeSearchData multiple_encode;
 
-            // load and process multiple artists
             log("load multiple artist data");
             load_artist_data(fetch_multiple_artists_query, multiple_artist_credit_ids, multiple_artist_credit_texts);
 
             for(unsigned int i = 0; i < multiple_artist_credit_ids.size(); i++) {
-                auto ret = encode.encode_string(multiple_artist_credit_texts[i]);
+                auto ret = multiple_encode.encode_string(multiple_artist_credit_texts[i]);
                 if (ret.size() == 0) {
                 }
                 else
@@ -567,68 +444,214 @@ class ArtistIndex {
             }
             vector<unsigned int>().swap(multiple_artist_credit_ids);
             vector<string>().swap(multiple_artist_credit_texts);
+        }
 
-            {
-                FuzzyIndex *multiple_artist_index = new FuzzyIndex();
-                log("build multiple artist index");
-                multiple_artist_index->build(multiple_ids, multiple_texts);
+        // A rough guess of the peak memory in MB that FuzzyIndex::build() needs for texts: the index keeps
+        // copies of them, and vectorising holds a few words for every trigram until the postings are made.
+        static size_t
+        build_memory_estimate(const vector<string> &texts) {
+            size_t bytes = 0;
+            for(auto &it : texts)
+                bytes += it.size();
+            return (bytes * 48 + texts.size() * 96) / (1024 * 1024) + 1;
+        }
 
-                std::stringstream ss_multiple;
-                {
-                    cereal::BinaryOutputArchive oarchive(ss_multiple);
-                    oarchive(*multiple_artist_index);
-                }
-                log("multiple artist index size: %lu bytes", ss_multiple.str().length());
-                delete multiple_artist_index;
-                vector<unsigned int>().swap(multiple_ids);
-                vector<string>().swap(multiple_texts);
-                
-                try
-                {
-                    SQLite::Database    db(db_file, SQLite::OPEN_READWRITE);
-                    SQLite::Statement   query(db, insert_blob_query);
-                
-                    log("save multiple artist index");
-                    query.bind(1, MULTIPLE_ARTIST_INDEX_ENTITY_ID);
-                    query.bind(2, (const char *)ss_multiple.str().c_str(), (int32_t)ss_multiple.str().length());
-                    query.exec();
-                }
-                catch (std::exception& e)
-                {
-                    printf("save multiple artist index db exception: %s\n", e.what());
-                }
+        void
+        build_index(const int entity_id, const char *name, vector<unsigned int> &ids, vector<string> &texts,
+                    unsigned int index_threads) {
+            FuzzyIndex *index = new FuzzyIndex();
+            log("build %s artist index", name);
+            index->build(ids, texts, index_threads);
+            vector<unsigned int>().swap(ids);
+            vector<string>().swap(texts);
+
+            if (!index->quantise_weights(weight_format))
+                log("%s artist index keeps float weights", name);
+            log("save %s artist index", name);
+            index->save_index_file(index_file(entity_id));
+            delete index;
+        }
+
+        // The multiple artists load while the single artists and their aliases do, each on a connection of
+        // its own, and then the three indexes are built at once, as far as build_memory allows. The build
+        // threads share num_threads in proportion to the number of texts they index.
+        void build() {
+            set<pair<unsigned int, string>> unique_artist_data, stupid_artist_data;
+
+            vector<unsigned int> single_ids, multiple_ids, stupid_ids;
+            vector<string>       single_texts, multiple_texts, stupid_texts; 
+
+            thread multiple_loader([&]() { load_multiple_artists(multiple_ids, multiple_texts); });
+            load_single_artists(unique_artist_data, stupid_artist_data);
+            
+            // Convert sets back to vectors for insertion into fuzzyindex
+            for(auto &it : unique_artist_data) {
+                single_ids.push_back(it.first);
+                single_texts.push_back(it.second);
+            }
+            set<pair<unsigned int, string>>().swap(unique_artist_data);
+
+            for(auto &it : stupid_artist_data) {
+                stupid_ids.push_back(it.first);
+                stupid_texts.push_back(it.second);
+            }
+            set<pair<unsigned int, string>>().swap(stupid_artist_data);
+            multiple_loader.join();
+
+            struct IndexBuild {
+                int                   entity_id;
+                const char           *name;
+                vector<unsigned int> *ids;
+                vector<string>       *texts;
+            };
+            vector<IndexBuild> builds = {
+                { SINGLE_ARTIST_INDEX_ENTITY_ID, "single", &single_ids, &single_texts },
+                { MULTIPLE_ARTIST_INDEX_ENTITY_ID, "multiple", &multiple_ids, &multiple_texts }
+            };
+            if (stupid_ids.size())
+                builds.push_back({ STUPID_ARTIST_INDEX_ENTITY_ID, "stupid", &stupid_ids, &stupid_texts });
+
+            // The largest first, so that the build that takes longest never waits for the budget
+            sort(builds.begin(), builds.end(), [](const IndexBuild &a, const IndexBuild &b) {
+                return a.texts->size() > b.texts->size();
+            });
+            size_t total_texts = 0;
+            for(auto &it : builds)
+                total_texts += it.texts->size();
+
+            MemoryBudget budget(build_memory);
+            vector<exception_ptr> errors(builds.size());
+            vector<thread> builders;
+            for(size_t i = 0; i < builds.size(); i++) {
+                size_t memory = build_memory_estimate(*builds[i].texts);
+                unsigned int index_threads = max(1ul, num_threads * builds[i].texts->size() / max(total_texts, 1ul));
+                budget.acquire(memory);
+                builders.push_back(thread([&, i, memory, index_threads]() {
+                    try {
+                        build_index(builds[i].entity_id, builds[i].name, *builds[i].ids, *builds[i].texts, index_threads);
+                    }
+                    catch (...) {
+                        errors[i] = current_exception();
+                    }
+                    budget.release(memory);
+                }));
             }
+            for(auto &it : builders)
+                it.join();
+            for(auto &it : errors)
+                if (it)
+                    rethrow_exception(it);
            
             log("done building artists indexes.");
         }
+
+        // Make index hold exactly the given documents. The documents of artist credits whose texts changed
+        // are removed and added again. Returns the number of artist credits that changed.
+        size_t
+        update_index(FuzzyIndex *index, const set<pair<unsigned int, string>> &documents) {
+            vector<pair<unsigned int, string>> current_documents;
+            index->get_documents(current_documents);
+
+            map<unsigned int, set<string>> current, wanted;
+            for(auto &it : current_documents)
+                current[it.first].insert(it.second);
+            vector<pair<unsigned int, string>>().swap(current_documents);
+            for(auto &it : documents)
+                wanted[it.first].insert(it.second);
+
+            vector<unsigned int> changed;
+            for(auto &it : current) {
+                auto w = wanted.find(it.first);
+                if (w == wanted.end() || w->second != it.second)
+                    changed.push_back(it.first);
+            }
+            for(auto &it : wanted)
+                if (current.find(it.first) == current.end())
+                    changed.push_back(it.first);
+
+            index->remove_documents(changed);
+            for(auto id : changed) {
+                auto w = wanted.find(id);
+                if (w != wanted.end())
+                    for(auto &text : w->second)
+                        index->add_document(id, text);
+            }
+            return changed.size();
+        }
+
+        // Bring the saved artist indexes up to date with the database without rebuilding them. The
+        // vocabulary of each index is kept, so a full build() is still needed from time to time.
+        // Returns false if there are no indexes to update.
+        bool update() {
+            try {
+                load();
+            }
+            catch (exception &e) {
+                log("cannot update artist indexes: %s", e.what());
+                return false;
+            }
+
+            set<pair<unsigned int, string>> single_artist_data, stupid_artist_data, multiple_artist_data;
+            load_single_artists(single_artist_data, stupid_artist_data);
+            log("update single artist index: %zu artist credits changed",
+                update_index(single_artist_index, single_artist_data));
+            log("update stupid artist index: %zu artist credits changed",
+                update_index(stupid_artist_index, stupid_artist_data));
+            set<pair<unsigned int, string>>().swap(single_artist_data);
+            set<pair<unsigned int, string>>().swap(stupid_artist_data);
+
+            vector<unsigned int> multiple_ids;
+            vector<string>       multiple_texts;
+            load_multiple_artists(multiple_ids, multiple_texts);
+            for(unsigned int i = 0; i < multiple_ids.size(); i++)
+                multiple_artist_data.insert({ multiple_ids[i], multiple_texts[i] });
+            vector<unsigned int>().swap(multiple_ids);
+            vector<string>().swap(multiple_texts);
+            log("update multiple artist index: %zu artist credits changed",
+                update_index(multiple_artist_index, multiple_artist_data));
+            set<pair<unsigned int, string>>().swap(multiple_artist_data);
+
+            log("merge artist index changes");
+            pair<int, FuzzyIndex *> indexes[] = {
+                { SINGLE_ARTIST_INDEX_ENTITY_ID, single_artist_index },
+                { MULTIPLE_ARTIST_INDEX_ENTITY_ID, multiple_artist_index },
+                { STUPID_ARTIST_INDEX_ENTITY_ID, stupid_artist_index }
+            };
+            vector<thread> merges;
+            for(auto &it : indexes)
+                if (it.second->num_pending_changes())
+                    merges.push_back(thread([this, it]() {
+                        if (it.second->merge_delta())
+                            it.second->save_index_file(index_file(it.first));
+                    }));
+            for(auto &it : merges)
+                it.join();
+
+            log("done updating artists indexes.");
+            return true;
+        }
         
+        string
+        index_file(const int entity_id) {
+            switch(entity_id) {
+                case SINGLE_ARTIST_INDEX_ENTITY_ID:
+                    return index_dir + string("/single_artist_index.idx");
+                case MULTIPLE_ARTIST_INDEX_ENTITY_ID:
+                    return index_dir + string("/multiple_artist_index.idx");
+                case STUPID_ARTIST_INDEX_ENTITY_ID:
+                    return index_dir + string("/stupid_artist_index.idx");
+            }
+            return "";
+        }
+
         bool
         load_index(const int entity_id, FuzzyIndex *index) {
-            try
-            {
-                SQLite::Database      db(db_file);
-                SQLite::Statement     query(db, fetch_blob_query);
-            
-                query.bind(1, entity_id);
-                if (query.executeStep()) {
-                    const void* blob_data = query.getColumn(0).getBlob();
-                    size_t blob_size = query.getColumn(0).getBytes();
-                    
-                    std::stringstream ss;
-                    ss.write(static_cast<const char*>(blob_data), blob_size);
-                    ss.seekg(ios_base::beg);
-                    {
-                        cereal::BinaryInputArchive iarchive(ss);
-                        iarchive(*index);
-                    }
-                    return true;
-                } else 
-                    return false;
-            }
-            catch (std::exception& e)
-            {
-                printf("load artist index db exception: %s\n", e.what());
-            }
+            // Index files are mapped in place. Index dirs built before they existed only have the index in the
+            // db, in a format that can't be loaded any more.
+            if (index->load_index_file(index_file(entity_id)))
+                return true;
+
+            log("cannot load %s, rebuild the artist indexes with make_indexes", index_file(entity_id).c_str());
             return false;
         }
 
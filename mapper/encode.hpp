@@ -1,11 +1,16 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <iostream>
 #include <map>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <mutex>
+#include <unordered_map>
 using namespace std;
 
 #include "defs.hpp"
@@ -19,6 +24,18 @@ using namespace std;
 
 typedef jpcre2::select<char> jp; 
 
+// Strings each EncodeCache generation holds
+const size_t ENCODE_CACHE_GENERATION_SIZE = 2048;
+
+// What encode_string() turns each character into: ASCII character c becomes ascii[c], or nothing if that
+// is 0, and code point c below U+10000 becomes arena[offsets[c], offsets[c + 1]).
+struct EncodeTable {
+    char                      ascii[128];
+    bool                      ascii_single;    // no ASCII character becomes more than one character
+    vector<uint32_t>          offsets;
+    string                    arena;
+};
+
 
 class EncodeSearchData {
     private:
@@ -52,8 +69,9 @@ class EncodeSearchData {
             return output;
         }
         
+        // The reference implementation of encode_string(), which takes three passes over the text
         string
-        encode_string(const string &text) {
+        encode_string_regex(const string &text) {
             // Remove spaces, punctuation, convert non-ascii characters to some romanized equivalent, lower case, return
             if (text.empty()) {
                 string a;
@@ -68,6 +86,125 @@ class EncodeSearchData {
             return ret;
         }
 
+        // Each step of encode_string_regex() works on one character at a time, so encoding every character on
+        // its own and putting the results together gives exactly the same bytes. The table holds those results,
+        // made once per process by the reference implementation itself.
+        const EncodeTable &
+        encode_table() {
+            static EncodeTable table;
+            static once_flag   made;
+            call_once(made, [this]() {
+                table.ascii_single = true;
+                table.offsets.reserve(0x10001);
+                table.offsets.push_back(0);
+                for(uint32_t cp = 0; cp < 0x10000; cp++) {
+                    // NUL is never a word character, and surrogates aren't characters at all
+                    if (cp != 0 && (cp < 0xd800 || cp >= 0xe000)) {
+                        char utf8[3];
+                        size_t len = encode_utf8(cp, utf8);
+                        table.arena += encode_string_regex(string(utf8, len));
+                    }
+                    table.offsets.push_back(table.arena.size());
+                    if (cp < 128) {
+                        uint32_t len = table.offsets[cp + 1] - table.offsets[cp];
+                        table.ascii[cp] = len ? table.arena[table.offsets[cp]] : 0;
+                        table.ascii_single = table.ascii_single && len <= 1;
+                    }
+                }
+            });
+            return table;
+        }
+
+        static size_t
+        encode_utf8(uint32_t cp, char *utf8) {
+            if (cp < 0x80) {
+                utf8[0] = cp;
+                return 1;
+            }
+            if (cp < 0x800) {
+                utf8[0] = 0xc0 | (cp >> 6);
+                utf8[1] = 0x80 | (cp & 0x3f);
+                return 2;
+            }
+            utf8[0] = 0xe0 | (cp >> 12);
+            utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+            utf8[2] = 0x80 | (cp & 0x3f);
+            return 3;
+        }
+
+        // Decode the character at text[i], advancing i past it. Returns UINT32_MAX for invalid UTF-8 and for
+        // characters beyond U+FFFF, which the table doesn't cover.
+        static uint32_t
+        decode_utf8(string_view text, size_t &i) {
+            uint8_t c = text[i];
+            if (c < 0x80) {
+                i++;
+                return c;
+            }
+            if (c >= 0xc2 && c < 0xe0 && i + 1 < text.size() && ((uint8_t)text[i + 1] & 0xc0) == 0x80) {
+                uint32_t cp = ((c & 0x1f) << 6) | ((uint8_t)text[i + 1] & 0x3f);
+                i += 2;
+                return cp;
+            }
+            if (c >= 0xe0 && c < 0xf0 && i + 2 < text.size() && ((uint8_t)text[i + 1] & 0xc0) == 0x80 &&
+                ((uint8_t)text[i + 2] & 0xc0) == 0x80) {
+                uint32_t cp = ((c & 0x0f) << 12) | (((uint8_t)text[i + 1] & 0x3f) << 6) | ((uint8_t)text[i + 2] & 0x3f);
+                // Overlong forms and surrogates are invalid
+                if (cp < 0x800 || (cp >= 0xd800 && cp < 0xe000))
+                    return UINT32_MAX;
+                i += 3;
+                return cp;
+            }
+            return UINT32_MAX;
+        }
+
+        // Pure ASCII text, checked eight bytes at a time
+        static bool
+        is_ascii(string_view text) {
+            uint64_t bits = 0;
+            size_t i = 0;
+            for(; i + 8 <= text.size(); i += 8) {
+                uint64_t word;
+                memcpy(&word, text.data() + i, sizeof(word));
+                bits |= word;
+            }
+            for(; i < text.size(); i++)
+                bits |= (uint8_t)text[i];
+            return (bits & 0x8080808080808080ull) == 0;
+        }
+
+        // Encode text into out in a single pass over the table, byte for byte the same as encode_string_regex().
+        // out keeps its capacity, so a reused buffer makes no allocations. Text with characters beyond U+FFFF
+        // or invalid UTF-8 is left to the reference implementation.
+        void
+        encode_string(string_view text, string &out) {
+            const EncodeTable &table = encode_table();
+            out.clear();
+
+            if (table.ascii_single && is_ascii(text)) {
+                for(char c : text)
+                    if (table.ascii[(uint8_t)c])
+                        out.push_back(table.ascii[(uint8_t)c]);
+                return;
+            }
+
+            for(size_t i = 0; i < text.size();) {
+                uint32_t cp = decode_utf8(text, i);
+                if (cp == UINT32_MAX) {
+                    out = encode_string_regex(string(text));
+                    return;
+                }
+                out.append(table.arena, table.offsets[cp], table.offsets[cp + 1] - table.offsets[cp]);
+            }
+        }
+
+        string
+        encode_string(const string &text) {
+            string ret;
+            encode_string(text, ret);
+            return ret;
+        }
+
         string
         encode_string_for_stupid_artists(const string &text) {
             //Remove spaces, convert non-ascii characters to some romanized equivalent, lower case, return
@@ -97,4 +234,60 @@ class EncodeSearchData {
             return result;
         }
 
-};
\ No newline at end of file
+};
+
+// A search string after encoding, with the words that FuzzyIndex searches vectorise
+struct EncodedString {
+    string                    encoded;
+    DocumentWords             words;      // of encoded cut to MAX_ENCODED_STRING_LENGTH
+};
+
+// A bounded memo of encoded search strings, for use by one thread. When the current generation is full
+// it replaces the old one, and strings found in the old generation move back to the current one, so the
+// strings that keep coming up stay cached while the rest age out.
+class EncodeCache {
+    private:
+        EncodeSearchData                       &encode;
+        unsigned int                            ngram_size;
+        unordered_map<string, EncodedString>    current, old;
+        unsigned long                           hits, misses;
+
+    public:
+
+        EncodeCache(EncodeSearchData &_encode, unsigned int _ngram_size = 3) :
+            encode(_encode), ngram_size(_ngram_size), hits(0), misses(0) {
+        }
+
+        // The returned entry stays valid until the next lookup
+        const EncodedString &
+        lookup(const string &text) {
+            auto it = current.find(text);
+            if (it != current.end()) {
+                hits++;
+                return it->second;
+            }
+
+            if (current.size() >= ENCODE_CACHE_GENERATION_SIZE) {
+                old.swap(current);
+                current.clear();
+            }
+
+            EncodedString entry;
+            auto old_it = old.find(text);
+            if (old_it != old.end()) {
+                hits++;
+                entry = std::move(old_it->second);
+                old.erase(old_it);
+            }
+            else {
+                misses++;
+                encode.encode_string(text, entry.encoded);
+                TfIdfVectorizer::count_words(string_view(entry.encoded).substr(0, MAX_ENCODED_STRING_LENGTH), ngram_size,
+                                             entry.words);
+            }
+            return current.emplace(text, std::move(entry)).first->second;
+        }
+
+        unsigned long get_hits() const { return hits; }
+        unsigned long get_misses() const { return misses; }
+};
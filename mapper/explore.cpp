@@ -210,7 +210,7 @@ class Explorer {
             auto artist_name = encode.encode_string(query);
             if (artist_name.size()) {
                 printf("ARTIST SEARCH: '%s' (%s)\n", query.c_str(), artist_name.c_str());
-                res = artist_index->single_artist_index->search(artist_name, 0.5, 's');
+                res = artist_index->single_artist_index->search(artist_name, 0.5, 's', true);
             }
             else {
                 // Try encoding for "stupid artists" (non-Latin characters, etc.)
@@ -221,7 +221,7 @@ class Explorer {
                 }
                 
                 printf("STUPID ARTIST SEARCH: '%s' (%s)\n", query.c_str(), stupid_name.c_str());
-                res = artist_index->stupid_artist_index->search(stupid_name, 0.5, 's');
+                res = artist_index->stupid_artist_index->search(stupid_name, 0.5, 's', true);
             }
             
             if (!res->size()) {
@@ -247,6 +247,8 @@ class Explorer {
                 
                 printf("%-40s %-10.2f %-8d\n", short_name.c_str(), result.confidence, result.id);
             }
+            printf("\nSearches with %d or more perfect matches so far: %lu\n", NUM_FUZZY_SEARCH_RESULTS,
+                   FuzzyIndex::get_expansion_count());
             printf("\n");
             delete res;
         }
@@ -260,11 +262,11 @@ class Explorer {
             
             // Search single artist index
             if (artist_index->single_artist_index) {
-                for (size_t i = 0; i < artist_index->single_artist_index->index_texts.size(); i++) {
-                    const string& text = artist_index->single_artist_index->index_texts[i];
+                for (size_t i = 0; i < artist_index->single_artist_index->index_ids.size(); i++) {
+                    string_view text = artist_index->single_artist_index->get_index_text(i);
                     if (text == encoded_text) {
                         unsigned int id = artist_index->single_artist_index->index_ids[i];
-                        string display_text = text.length() > 40 ? text.substr(0, 40) : text;
+                        string display_text(text.substr(0, 40));
                         printf("%-8zu %-8u %-40s [single]\n", i, id, display_text.c_str());
                         found_any = true;
                     }
@@ -273,11 +275,11 @@ class Explorer {
             
             // Search multiple artist index
             if (artist_index->multiple_artist_index) {
-                for (size_t i = 0; i < artist_index->multiple_artist_index->index_texts.size(); i++) {
-                    const string& text = artist_index->multiple_artist_index->index_texts[i];
+                for (size_t i = 0; i < artist_index->multiple_artist_index->index_ids.size(); i++) {
+                    string_view text = artist_index->multiple_artist_index->get_index_text(i);
                     if (text == encoded_text) {
                         unsigned int id = artist_index->multiple_artist_index->index_ids[i];
-                        string display_text = text.length() > 40 ? text.substr(0, 40) : text;
+                        string display_text(text.substr(0, 40));
                         printf("%-8zu %-8u %-40s [multiple]\n", i, id, display_text.c_str());
                         found_any = true;
                     }
@@ -286,11 +288,11 @@ class Explorer {
             
             // Search stupid artist index
             if (artist_index->stupid_artist_index) {
-                for (size_t i = 0; i < artist_index->stupid_artist_index->index_texts.size(); i++) {
-                    const string& text = artist_index->stupid_artist_index->index_texts[i];
+                for (size_t i = 0; i < artist_index->stupid_artist_index->index_ids.size(); i++) {
+                    string_view text = artist_index->stupid_artist_index->get_index_text(i);
                     if (text == encoded_text) {
                         unsigned int id = artist_index->stupid_artist_index->index_ids[i];
-                        string display_text = text.length() > 40 ? text.substr(0, 40) : text;
+                        string display_text(text.substr(0, 40));
                         printf("%-8zu %-8u %-40s [stupid]\n", i, id, display_text.c_str());
                         found_any = true;
                     }
@@ -310,7 +312,7 @@ class Explorer {
             auto artist_name = encode.encode_string(query);
             if (artist_name.size()) {
                 printf("MULTIPLE ARTIST SEARCH: '%s' (%s)\n", query.c_str(), artist_name.c_str());
-                res = artist_index->multiple_artist_index->search(artist_name, 0.5, 'm');
+                res = artist_index->multiple_artist_index->search(artist_name, 0.5, 'm', true);
             }
             if (!res->size()) {
                 printf("  No results found.\n");
@@ -347,7 +349,7 @@ class Explorer {
             }
             
             printf("STUPID ARTIST SEARCH: '%s' (%s)\n", query.c_str(), stupid_name.c_str());
-            res = artist_index->stupid_artist_index->search(stupid_name, 0.5, 's');
+            res = artist_index->stupid_artist_index->search(stupid_name, 0.5, 's', true);
             
             if (!res->size()) {
                 printf("  No results found.\n");
@@ -360,7 +362,7 @@ class Explorer {
             printf("------------------------------------------------------------------------\n");
             
             for (auto &result : *res) {
-                string text = artist_index->stupid_artist_index->get_index_text(result.result_index);
+                string text(artist_index->stupid_artist_index->get_index_text(result.result_index));
                 string short_name = text.length() > 40 ? text.substr(0, 40) : text;
                 printf("%-40s %-10.2f %-8d\n", short_name.c_str(), result.confidence, result.id);
             }
@@ -469,8 +471,8 @@ class Explorer {
                             // Only add if we haven't seen this release_index before
                             if (unique_releases.find(link.release_index) == unique_releases.end()) {
                                 string release_text = "";
-                                if (link.release_index < data->release_index->index_texts.size()) {
-                                    release_text = data->release_index->index_texts[link.release_index];
+                                if (link.release_index < data->release_index->index_ids.size()) {
+                                    release_text = data->release_index->get_index_text(link.release_index);
                                     if (release_text.length() > 50) {
                                         release_text = release_text.substr(0, 50);
                                     }
@@ -545,7 +547,7 @@ class Explorer {
                     vector<pair<unsigned int, string>> recordings;
                     for (size_t i = 0; i < data->recording_index->index_ids.size(); i++) {
                         unsigned int id = data->recording_index->index_ids[i];
-                        string text = data->recording_index->index_texts[i];
+                        string text(data->recording_index->get_index_text(i));
                         recordings.push_back(make_pair(id, text));
                     }
                     
@@ -613,8 +615,8 @@ class Explorer {
                         for (const auto& link : links_vector) {
                             // Get release name (truncate to 20 chars)
                             string release_name = "";
-                            if (data->release_index && link.release_index < data->release_index->index_texts.size()) {
-                                release_name = data->release_index->index_texts[link.release_index];
+                            if (data->release_index && link.release_index < data->release_index->index_ids.size()) {
+                                release_name = data->release_index->get_index_text(link.release_index);
                                 if (release_name.length() > 20) {
                                     release_name = release_name.substr(0, 20);
                                 }
@@ -622,8 +624,8 @@ class Explorer {
                             
                             // Get recording name (truncate to 20 chars)
                             string recording_name = "";
-                            if (data->recording_index && link.recording_index < data->recording_index->index_texts.size()) {
-                                recording_name = data->recording_index->index_texts[link.recording_index];
+                            if (data->recording_index && link.recording_index < data->recording_index->index_ids.size()) {
+                                recording_name = data->recording_index->get_index_text(link.recording_index);
                                 if (recording_name.length() > 20) {
                                     recording_name = recording_name.substr(0, 20);
                                 }
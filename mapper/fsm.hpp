@@ -144,6 +144,8 @@ class MappingSearch {
     // FSM variables that carry state for the machine
     // current artist credit name represents the cleaned and/or encoded version of the artist credit
     string                              current_artist_credit_name;
+    DocumentWords                       current_artist_credit_words;
+    bool                                has_artist_credit_words;
     unsigned int                        selected_artist_credit_id;
     unsigned int                        selected_recording_id;
     unsigned int                        selected_release_id;
@@ -151,6 +153,16 @@ class MappingSearch {
     bool                                has_cleaned_artist, artist_name_cleaned;
     ReleaseRecordingIndex              *release_recording_index;
     vector<IndexResult>                *artist_matches, *release_matches, *recording_matches;     
+
+    // The match pointers above point into these buffers, which are reused along with the index
+    // search scratch memory from one search to the next
+    vector<IndexResult>                 artist_results, multiple_artist_results, release_results, recording_results;
+    FuzzySearchContext                  search_context;
+
+    // The indexes return only the exact matches of a name when there are any. Once those have all been
+    // tried, the name is searched again for fuzzy alternatives, leaving out the matches already tried.
+    bool                                artist_matches_exact, recording_matches_exact;
+    vector<unsigned int>                tried_matches;
     int                                 artist_match_index, release_match_index, recording_match_index;
     SearchMatch                        *search_match;
     float                               artist_confidence, release_confidence, recording_confidence;
@@ -164,7 +176,7 @@ class MappingSearch {
             index_cache = _index_cache;    // Shared, don't delete
             search_functions = new SearchFunctions(index_dir, index_cache);
 
-            // Initialize pointers to nullptr before reset_state_variables() tries to delete them
+            // Initialize pointers to nullptr before reset_state_variables() tries to delete search_match
             artist_matches = nullptr;
             release_matches = nullptr;
             recording_matches = nullptr;
@@ -231,6 +243,7 @@ class MappingSearch {
             current_state = state_start;
             artist_name_cleaned = false;
             current_artist_credit_name.clear();
+            has_artist_credit_words = false;
 
             selected_artist_credit_id = 0;
             selected_recording_id = 0;
@@ -240,16 +253,16 @@ class MappingSearch {
             artist_match_index = -1;
             release_match_index = -1;
             recording_match_index = -1;
+            artist_matches_exact = false;
+            recording_matches_exact = false;
 
             artist_confidence = 0.0;
             release_confidence = 0.0;
             recording_confidence = 0.0;
 
-            delete artist_matches;
+            // the result buffers are kept for the next search
             artist_matches = nullptr;
-            delete release_matches;
             release_matches = nullptr;
-            delete recording_matches;
             recording_matches = nullptr;
 
             // don't delete indexes -- the cache owns the objects
@@ -261,12 +274,15 @@ class MappingSearch {
 
         bool do_artist_name_check() {
             // set current_artist_credit_name
-            auto encoded_artist_credit_name = encode.encode_string(artist_credit_name); 
-            if (encoded_artist_credit_name.size()) {
-                current_artist_credit_name = encoded_artist_credit_name;
+            const EncodedString &encoded_artist_credit_name = search_functions->encode_query(artist_credit_name);
+            if (encoded_artist_credit_name.encoded.size()) {
+                current_artist_credit_name = encoded_artist_credit_name.encoded;
+                current_artist_credit_words = encoded_artist_credit_name.words;
+                has_artist_credit_words = true;
                 return enter_transition(event_normal_name);
             }
             else {
+                has_artist_credit_words = false;
                 current_artist_credit_name = encode.encode_string_for_stupid_artists(artist_credit_name); 
                 return enter_transition(event_stupid_name);
             }
@@ -274,19 +290,38 @@ class MappingSearch {
         
         bool do_artist_search() {
             // define and store results in artist_matches
-            if (artist_matches != nullptr)
-                delete artist_matches;
-
             log("ARTIST SEARCH: '%s' (%s)", artist_credit_name.c_str(), current_artist_credit_name.c_str());
             auto start = std::chrono::high_resolution_clock::now();
-            artist_matches = artist_index->single_artist_index->search(current_artist_credit_name, artist_threshold, 's');
-            auto multiple_artist_matches = artist_index->multiple_artist_index->search(current_artist_credit_name, artist_threshold, 'm');
-            artist_matches->insert(artist_matches->end(), multiple_artist_matches->begin(), multiple_artist_matches->end()); 
-            delete multiple_artist_matches;
+            search_artist_indexes(false);
             auto end = std::chrono::high_resolution_clock::now();
             auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
             log("Artist search took %ld ms", duration.count()); 
             
+            if (artist_matches->size())
+                return enter_transition(event_has_matches);
+            else {
+                artist_matches = nullptr;
+                if (has_cleaned_artist) 
+                    return enter_transition(event_no_matches);
+                else
+                    return enter_transition(event_no_matches_not_cleaned);
+            }
+        }
+
+        // Fill artist_results with the matches for current_artist_credit_name from the single and multiple
+        // artist indexes, best first
+        void search_artist_indexes(bool fuzzy_alternatives) {
+            const DocumentWords *words = has_artist_credit_words ? &current_artist_credit_words : nullptr;
+            bool single_exact = artist_index->single_artist_index->search(current_artist_credit_name, words, artist_threshold,
+                                                                          's', artist_results, search_context,
+                                                                          fuzzy_alternatives);
+            bool multiple_exact = artist_index->multiple_artist_index->search(current_artist_credit_name, words,
+                                                                              artist_threshold, 'm', multiple_artist_results,
+                                                                              search_context, fuzzy_alternatives);
+            artist_matches_exact = single_exact || multiple_exact;
+            artist_results.insert(artist_results.end(), multiple_artist_results.begin(), multiple_artist_results.end()); 
+            artist_matches = &artist_results;
+
             if (artist_matches->size()) {
                 sort(artist_matches->begin(), artist_matches->end(), [](const IndexResult& a, const IndexResult& b) {
                     return a.confidence > b.confidence;
@@ -297,17 +332,44 @@ class MappingSearch {
                     string name = search_functions->get_artist_credit_name(result.id);
                     log("      %.2f %-8u %c %s", result.confidence, result.id, result.source, name.c_str());
                 }
-
-                return enter_transition(event_has_matches);
             }
+        }
+
+        // Search the artist name again for fuzzy alternatives to the exact matches, which have all been tried
+        void widen_artist_matches() {
+            log("    exact artist matches exhausted, searching for alternatives");
+            tried_matches.clear();
+            for(const auto &result : *artist_matches)
+                tried_matches.push_back(result.id);
+
+            if (has_artist_credit_words)
+                search_artist_indexes(true);
             else {
-                delete artist_matches;
-                artist_matches = nullptr;
-                if (has_cleaned_artist) 
-                    return enter_transition(event_no_matches);
-                else
-                    return enter_transition(event_no_matches_not_cleaned);
+                artist_index->stupid_artist_index->search(current_artist_credit_name, .7, 's', artist_results,
+                                                          search_context, true);
+                artist_matches_exact = false;
+                artist_matches = &artist_results;
             }
+            artist_results.erase(remove_if(artist_results.begin(), artist_results.end(), [&](const IndexResult &result) {
+                return find(tried_matches.begin(), tried_matches.end(), result.id) != tried_matches.end();
+            }), artist_results.end());
+            artist_match_index = 0;
+        }
+
+        // Search the recording name again for fuzzy alternatives to the exact matches, which have all been tried
+        void widen_recording_matches() {
+            log("    exact recording matches exhausted, searching for alternatives");
+            tried_matches.clear();
+            for(const auto &result : *recording_matches)
+                tried_matches.push_back(result.result_index);
+
+            recording_matches_exact = search_functions->recording_search(release_recording_index, recording_name,
+                                                                         recording_results, search_context, true);
+            recording_matches = &recording_results;
+            recording_results.erase(remove_if(recording_results.begin(), recording_results.end(), [&](const IndexResult &result) {
+                return find(tried_matches.begin(), tried_matches.end(), result.result_index) != tried_matches.end();
+            }), recording_results.end());
+            recording_match_index = 0;
         }
 
         bool do_clean_artist_name() {
@@ -325,19 +387,18 @@ class MappingSearch {
             // define and store results in artist_matches
             // set artist_match_index to -1, not defined
             // TODO: improve thresholding
-            if (artist_matches != nullptr)
-                delete artist_matches;
             artist_match_index = -1;
 
             auto start = std::chrono::high_resolution_clock::now();
-            artist_matches = artist_index->stupid_artist_index->search(current_artist_credit_name, .7, 's');
+            artist_matches_exact = artist_index->stupid_artist_index->search(current_artist_credit_name, .7, 's',
+                                                                             artist_results, search_context);
+            artist_matches = &artist_results;
             auto end = std::chrono::high_resolution_clock::now();
             auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
             log("Stupid artist search took %ld ms", duration.count());
             if (artist_matches->size()) {
                 return enter_transition(event_has_matches);
             } else {
-                delete artist_matches;
                 artist_matches = nullptr;
                 return enter_transition(event_no_matches);
             }
@@ -351,6 +412,8 @@ class MappingSearch {
                 artist_match_index = 0;
             else
                 artist_match_index++;
+            if (artist_match_index >= artist_matches->size() && artist_matches_exact)
+                widen_artist_matches();
 
             if (artist_match_index < artist_matches->size() && (*artist_matches)[artist_match_index].confidence >= artist_threshold) {
                 selected_artist_credit_id = (*artist_matches)[artist_match_index].id;
@@ -358,7 +421,6 @@ class MappingSearch {
 
                 // Invalidate the current recording matches
                 recording_match_index  = -1;
-                delete recording_matches;
                 recording_matches = nullptr;
 
                 // don't delete the index, its owned by the cache
@@ -383,9 +445,10 @@ class MappingSearch {
                 }
             }
 
-            delete recording_matches;
             auto start = std::chrono::high_resolution_clock::now();
-            recording_matches = search_functions->recording_search(release_recording_index, recording_name); 
+            recording_matches_exact = search_functions->recording_search(release_recording_index, recording_name,
+                                                                         recording_results, search_context); 
+            recording_matches = &recording_results;
             auto end = std::chrono::high_resolution_clock::now();
             auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
             log("Recording search took %ld ms", duration.count());
@@ -401,6 +464,8 @@ class MappingSearch {
                 recording_match_index = 0;
             else
                 recording_match_index++;
+            if (recording_match_index >= recording_matches->size() && recording_matches_exact)
+                widen_recording_matches();
 
             if (recording_match_index < recording_matches->size() && (*recording_matches)[recording_match_index].confidence >= recording_threshold) {
                 selected_recording_id = (*recording_matches)[recording_match_index].id;
@@ -431,9 +496,9 @@ class MappingSearch {
                 }
             }
 
-            delete release_matches;
             auto start = std::chrono::high_resolution_clock::now();
-            release_matches = search_functions->release_search(release_recording_index, release_name); 
+            search_functions->release_search(release_recording_index, release_name, release_results, search_context); 
+            release_matches = &release_results;
             auto end = std::chrono::high_resolution_clock::now();
             auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
             log("Release search took %ld ms", duration.count());
@@ -454,9 +519,9 @@ class MappingSearch {
                 return enter_transition(event_has_matches);
 
             // set release_match by looking up canonical release given artist and recording
-            release_matches = search_functions->get_canonical_release_id(selected_artist_credit_id, selected_recording_id);
-            if (release_matches == nullptr)
+            if (!search_functions->get_canonical_release_id(selected_artist_credit_id, selected_recording_id, release_results))
                 return enter_transition(event_no_matches);
+            release_matches = &release_results;
 
             release_match_index = 0;
             log("canonical release id: %u", (*release_matches)[release_match_index].id);
@@ -4,244 +4,1710 @@
 #include <iostream>
 #include <map>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_set>
+#include <sstream>
+#include <string.h>
 #include <math.h>
+#include <limits.h>
+#include <span>
 using namespace std;
 
 #include "defs.hpp"
 #include "tfidf_vectorizer.hpp"
 #include "levenshtein.hpp"
+#include "index_file.hpp"
+#include "score_kernels.hpp"
+#include "qgram_filter.hpp"
 
 #include <cereal/archives/binary.hpp>
 #include <cereal/types/vector.hpp>
 #include <cereal/types/string.hpp>
 
-#include "index.h"
-#include "init.h"
-#include "index.h"
-#include "params.h"
-#include "rangequery.h"
-#include "knnquery.h"
-#include "knnqueue.h"
-#include "methodfactory.h"
-#include "spacefactory.h"
-#include "space.h"
-#include "space/space_vector.h"
-#include "space/space_sparse_vector.h"
-#include "knnquery.h"
-#include "knnqueue.h"
-
 const auto NUM_FUZZY_SEARCH_RESULTS = 10;
+const auto MAX_FUZZY_SEARCH_RESULTS = 1000;
+
+// Postings per block of a packed posting list, see FuzzyIndex::pack_postings()
+const unsigned int POSTING_BLOCK_SIZE = 128;
+// Zero bytes after the last packed posting list, so that unpacking may read whole words past a block
+const size_t POSTING_BLOCK_PADDING = 8;
+
+// Scores are accumulated in float and the per-term upper bounds are summed in a different
+// order, so pruning decisions leave this much headroom to never drop a qualifying document.
+// Every term is added with a fused multiply-add, as the score kernels do, so a score comes out
+// the same whichever code path or instruction set computed it.
+const float SCORE_BOUND_EPSILON = 1e-5;
+
+// Identical texts produce identical unit vectors, but their float dot product can land a hair below 1.0
+const float PERFECT_MATCH_CONFIDENCE = 1.0 - SCORE_BOUND_EPSILON;
+
+// A FuzzyIndex serialised with cereal, as index blobs in the index cache are, starts with these. A blob of
+// any other format isn't loaded, and IndexerThread deletes it so that it gets built again.
+const uint32_t FUZZY_INDEX_BLOB_MAGIC = 0x425a464c;    // "LFZB"
+const uint32_t FUZZY_INDEX_BLOB_VERSION = 3;    // 2: long text filter, 3: vocabulary fingerprint
+
+// Sections of a FuzzyIndex index file, see save_index_file()
+enum FuzzyIndexSection {
+    FUZZY_SECTION_VECTORIZER = 0,
+    FUZZY_SECTION_INDEX_IDS,
+    FUZZY_SECTION_TEXT_OFFSETS,
+    FUZZY_SECTION_TEXTS,
+    FUZZY_SECTION_POSTING_OFFSETS,
+    FUZZY_SECTION_POSTING_IDS,
+    FUZZY_SECTION_POSTING_WEIGHTS,
+    FUZZY_SECTION_TERM_MAX_WEIGHTS,
+    FUZZY_SECTION_WEIGHT_FORMAT,
+    FUZZY_SECTION_EXACT_SLOTS,
+    FUZZY_SECTION_LONG_TEXT_FORMAT,
+    FUZZY_SECTION_LONG_TEXT_FILTER,     // the first of QGRAM_FILTER_SECTIONS
+    NUM_FUZZY_SECTIONS = FUZZY_SECTION_LONG_TEXT_FILTER + QGRAM_FILTER_SECTIONS
+};
+
+// How posting weights are stored, see FuzzyIndex::quantise_weights()
+enum WeightFormat {
+    WEIGHT_FORMAT_FLOAT = 0,
+    WEIGHT_FORMAT_FP16,
+    WEIGHT_FORMAT_UINT8,
+    WEIGHT_FORMAT_PACKED
+};
+
+// IEEE half precision conversion, rounding to nearest even. The relative error is at most 2^-11.
+inline uint16_t
+float_to_half(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (exponent >= 31)
+        return sign | 0x7c00;
+    if (exponent <= 0) {
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return sign | half;
+    }
+
+    // A carry out of the mantissa correctly bumps the exponent
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return sign | half;
+}
+
+inline float
+half_to_float(uint16_t half) {
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    uint32_t bits;
+
+    if (exponent == 0) {
+        float value = mantissa * (1.0f / 16777216.0f);
+        memcpy(&bits, &value, sizeof(bits));
+        bits |= sign;
+    }
+    else if (exponent == 31)
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    else
+        bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// The score kernels take a zero score to mean that a document has no postings yet, so a posting weight
+// must not quantise to zero. Weights too small for half precision are kept as its smallest one instead.
+inline uint16_t
+quantise_fp16_weight(float weight) {
+    uint16_t half = float_to_half(weight);
+    return half == 0 && weight > 0 ? 1 : half;
+}
+
+// A weight as uint8 relative to the largest weight of its term, 1 at least for one below 1/510 of it
+inline uint8_t
+quantise_uint8_weight(float weight, float max_weight) {
+    long value = lround(weight / max_weight * 255);
+    return weight > 0 ? max(1L, value) : value;
+}
+
+inline bool
+is_ascii_text(string_view text) {
+    for(char ch : text)
+        if ((uint8_t)ch >= 0x80)
+            return false;
+    return true;
+}
+
+// Decode UTF-8 text onto the end of codepoints. A byte that doesn't start a valid sequence becomes U+DC00
+// plus the byte, which keeps it apart from every character.
+inline void
+append_codepoints(string_view text, vector<uint32_t> &codepoints) {
+    for(size_t i = 0; i < text.size();) {
+        uint8_t lead = text[i];
+        size_t length = lead < 0x80 ? 1 : (lead & 0xe0) == 0xc0 ? 2 : (lead & 0xf0) == 0xe0 ? 3 : (lead & 0xf8) == 0xf0 ? 4 : 0;
+        uint32_t codepoint = lead & (0xff >> (length + 1));
+        bool valid = length > 0 && i + length <= text.size();
+        for(size_t j = 1; valid && j < length; j++) {
+            valid = ((uint8_t)text[i + j] & 0xc0) == 0x80;
+            codepoint = codepoint << 6 | ((uint8_t)text[i + j] & 0x3f);
+        }
+        if (valid) {
+            codepoints.push_back(codepoint);
+            i += length;
+        }
+        else
+            codepoints.push_back(0xdc00 | (uint8_t)text[i++]);
+    }
+}
+
+struct QueryTerm {
+    unsigned int   term;
+    float          weight;
+    float          bound;      // weight * largest posting weight for this term
+};
+
+// Scratch memory for FuzzyIndex searches. The buffers keep their capacity from one search to the next,
+// so once they have grown to fit, a search makes no heap allocations. A context may be used with any
+// number of indexes, but by only one thread at a time.
+struct FuzzySearchContext {
+    vector<pair<size_t, double>>  features;
+    vector<QueryTerm>             query;
+    vector<float>                 remaining;
+    vector<float>                 accumulator;    // all zero between searches
+    vector<unsigned int>          candidates;
+    vector<ScoredDoc>             hits;
+    vector<float>                 scores;
+    vector<unsigned int>          term_docs;      // one posting list, decoded
+    vector<float>                 term_weights;
+    QGramScratch                  qgrams;
+    LevPattern                    pattern;        // the query, for edit distances against the full texts
+    vector<uint32_t>              query_codepoints;
+    vector<uint32_t>              text_codepoints;
+};
 
 class FuzzyIndex {
     private:
-        similarity::Index<float> *index = nullptr;
-        similarity::Space<float> *space = nullptr;
      	TfIdfVectorizer           vectorizer;
-        similarity::ObjectVector  vectorized_data;
 
-    public:
+        // An index built against a shared vocabulary (see build()) uses that instead of its own vectorizer,
+        // and only keeps the features its documents have: term t is feature term_features[t] of the shared
+        // vocabulary, in ascending order. The vocabulary isn't saved with the index, so a loaded index needs
+        // use_vocabulary() before it can be searched.
+        bool                      has_shared_vocabulary;
+        shared_ptr<const TfIdfVectorizer> shared_vectorizer;
+        FlatArray<uint32_t>       term_features;
+        // The fingerprint of the shared vocabulary, so that a vocabulary fitted again isn't taken for it
+        uint64_t                  vocabulary_fingerprint;
+
+        // Trigram inverted index in CSR layout: the postings for term t live in
+        // [posting_offsets[t], posting_offsets[t + 1]) of posting_ids/posting_weights,
+        // sorted by document index.
+        FlatArray<unsigned int>   posting_offsets;
+        FlatArray<unsigned int>   posting_ids;
+        FlatArray<float>          posting_weights;
+
+        // The largest weight in each posting list, which bounds what a term can add to a score
+        FlatArray<float>          term_max_weights;
+
+        // The full text field of each document, needed for matching long query strings. The text of
+        // document i is text_arena[text_offsets[i], text_offsets[i + 1]).
+        FlatArray<char>           text_arena;
+        FlatArray<uint32_t>       text_offsets;
+
+        // Finds the documents whose text equals a query without scoring anything: an open addressing hash
+        // table with linear probing, keyed by text_hash() of the text. A slot holds a document number plus one,
+        // or 0 if it is empty, and there are at least twice as many slots as documents.
+        FlatArray<uint32_t>       exact_slots;
+
+        // In a quantised index posting_weights is empty and one of these holds the weights instead.
+        // uint8 weights are relative to the largest weight of their term.
+        int                       weight_format;
+        FlatArray<uint16_t>       posting_weights_fp16;
+        FlatArray<uint8_t>        posting_weights_uint8;
+
+        // A packed index keeps neither posting ids nor weights. The postings of term t are compressed into
+        // posting_blocks[posting_block_offsets[t], posting_block_offsets[t + 1]) instead, and posting_offsets
+        // only gives the length of each list.
+        FlatArray<uint32_t>       posting_block_offsets;
+        FlatArray<uint8_t>        posting_blocks;
+
+        // Picks the texts that long queries are compared with, see search_long_query(). If any text isn't
+        // ASCII the filter indexes code points, so that edit distances count characters rather than the
+        // bytes of their UTF-8 encoding.
+        QGramFilter               long_text_filter;
+        bool                      long_texts_by_codepoint;
+
+        // Keeps the index file mapped while the arrays above view it
+        shared_ptr<MappedIndexFile> mapped_file;
+
+        // Documents added since the index was built, searched alongside it until merge_delta() folds them
+        // into the arrays above. Delta document i is document number index_ids.size() + i, and its features
+        // are delta_terms/delta_weights[delta_offsets[i], delta_offsets[i + 1]), sorted by term.
+        vector<unsigned int>      delta_ids;
+        vector<string>            delta_texts;
+        vector<unsigned int>      delta_offsets;
+        vector<unsigned int>      delta_terms;
+        vector<float>             delta_weights;
+
+        // Trigrams that the vocabulary doesn't know still count towards the norm of an added document, with
+        // the idf they would have got had they been in the data the index was built from
+        double                    unknown_term_idf;
+
+        // Removed documents, by document number. Empty until the first removal.
+        vector<bool>              tombstones;
+        size_t                    num_removed;
+
+        // Searches hold update_mutex shared, changes to the documents hold it exclusively
+        mutable shared_mutex      update_mutex;
+        mutex                     merge_mutex;
+
+        void
+        clear() {
+            vectorizer = TfIdfVectorizer(false, false, true, -1, "l2", false, vectorizer.get_ngram_size());
+            has_shared_vocabulary = false;
+            shared_vectorizer.reset();
+            term_features.assign(vector<uint32_t>());
+            vocabulary_fingerprint = 0;
+            index_ids.assign(vector<unsigned int>());
+            text_arena.assign(vector<char>());
+            text_offsets.assign(vector<uint32_t>());
+            exact_slots.assign(vector<uint32_t>());
+            posting_offsets.assign(vector<unsigned int>());
+            posting_ids.assign(vector<unsigned int>());
+            posting_weights.assign(vector<float>());
+            term_max_weights.assign(vector<float>());
+            weight_format = WEIGHT_FORMAT_FLOAT;
+            posting_weights_fp16.assign(vector<uint16_t>());
+            posting_weights_uint8.assign(vector<uint8_t>());
+            posting_block_offsets.assign(vector<uint32_t>());
+            posting_blocks.assign(vector<uint8_t>());
+            long_text_filter.clear();
+            long_texts_by_codepoint = false;
+            mapped_file.reset();
+            delta_ids.clear();
+            delta_texts.clear();
+            delta_offsets.assign(1, 0);
+            delta_terms.clear();
+            delta_weights.clear();
+            unknown_term_idf = 0.0;
+            tombstones.clear();
+            num_removed = 0;
+        }
+
+        // Whether the arrays fit together, so that searches can't read past any of them. Loaded indexes are
+        // checked before they are used.
+        bool
+        arrays_consistent() const {
+            bool ok = text_offsets.size() == index_ids.size() + 1 &&
+                      text_offsets.back() == text_arena.size() &&
+                      posting_offsets.size() == term_max_weights.size() + 1 &&
+                      (!has_shared_vocabulary || term_features.size() == term_max_weights.size());
+            for(size_t i = 1; ok && i < text_offsets.size(); i++)
+                ok = text_offsets[i - 1] <= text_offsets[i];
+            for(size_t i = 1; ok && i < posting_offsets.size(); i++)
+                ok = posting_offsets[i - 1] <= posting_offsets[i];
+            // feature_term() looks features up by binary search
+            for(size_t t = 1; ok && has_shared_vocabulary && t < term_features.size(); t++)
+                ok = term_features[t - 1] < term_features[t];
+            if (!ok)
+                return false;
+
+            switch(weight_format) {
+                case WEIGHT_FORMAT_FLOAT:
+                    ok = posting_offsets.back() == posting_ids.size() && posting_weights.size() == posting_ids.size();
+                    break;
+                case WEIGHT_FORMAT_FP16:
+                    ok = posting_offsets.back() == posting_ids.size() && posting_weights_fp16.size() == posting_ids.size();
+                    break;
+                case WEIGHT_FORMAT_UINT8:
+                    ok = posting_offsets.back() == posting_ids.size() && posting_weights_uint8.size() == posting_ids.size();
+                    break;
+                case WEIGHT_FORMAT_PACKED:
+                    if (posting_block_offsets.size() != posting_offsets.size() ||
+                        posting_blocks.size() != posting_block_offsets.back() + POSTING_BLOCK_PADDING)
+                        return false;
+                    for(size_t t = 0; t + 1 < posting_offsets.size(); t++)
+                        if (posting_block_offsets[t + 1] < posting_block_offsets[t] || !packed_term_consistent(t))
+                            return false;
+                    return true;
+                default:
+                    return false;
+            }
+            // The score kernels accumulate into an array of one score per document
+            for(size_t p = 0; ok && p < posting_ids.size(); p++)
+                ok = posting_ids[p] < index_ids.size();
+            return ok;
+        }
+
+        bool
+        is_removed(unsigned int doc) const {
+            return doc < tombstones.size() && tombstones[doc];
+        }
+
+        unsigned int
+        document_id(unsigned int doc) const {
+            return doc < index_ids.size() ? index_ids[doc] : delta_ids[doc - index_ids.size()];
+        }
+
+        const TfIdfVectorizer &
+        get_vectorizer() const {
+            return shared_vectorizer ? *shared_vectorizer : vectorizer;
+        }
+
+        // The term of a vocabulary feature, or UINT_MAX if no document has it
+        unsigned int
+        feature_term(size_t feature) const {
+            if (!has_shared_vocabulary)
+                return feature < term_max_weights.size() ? feature : UINT_MAX;
+            auto it = lower_bound(term_features.begin(), term_features.end(), feature);
+            return it != term_features.end() && *it == feature ? it - term_features.begin() : UINT_MAX;
+        }
+
+        size_t
+        term_feature(unsigned int term) const {
+            return has_shared_vocabulary ? term_features[term] : term;
+        }
+
+        // Take over the posting lists of every vocabulary feature. With a shared vocabulary the features
+        // that have no postings are dropped.
+        void
+        set_postings(vector<unsigned int> &&term_offsets, vector<unsigned int> &&ids, vector<float> &&weights) {
+            if (has_shared_vocabulary) {
+                vector<uint32_t> features;
+                vector<unsigned int> offsets = { 0 };
+                for(size_t f = 0; f + 1 < term_offsets.size(); f++)
+                    if (term_offsets[f + 1] > term_offsets[f]) {
+                        features.push_back(f);
+                        offsets.push_back(term_offsets[f + 1]);
+                    }
+                term_features.assign(std::move(features));
+                term_offsets.swap(offsets);
+            }
+            posting_offsets.assign(std::move(term_offsets));
+            posting_ids.assign(std::move(ids));
+            posting_weights.assign(std::move(weights));
+            compute_term_bounds();
+        }
+
+        void
+        compute_term_bounds() {
+            size_t num_terms = posting_offsets.size() ? posting_offsets.size() - 1 : 0;
+            vector<float> max_weights(num_terms, 0.0);
+            for(size_t t = 0; t < num_terms; t++)
+                for(unsigned int p = posting_offsets[t]; p < posting_offsets[t + 1]; p++)
+                    max_weights[t] = max(max_weights[t], posting_weights[p]);
+            term_max_weights.assign(std::move(max_weights));
+        }
+
+        // FNV-1a, which is stable across builds and platforms, as hashes saved in index files must be
+        static uint64_t
+        text_hash(string_view text) {
+            uint64_t hash = 0xcbf29ce484222325ull;
+            for(unsigned char ch : text)
+                hash = (hash ^ ch) * 0x100000001b3ull;
+            return hash;
+        }
+
+        void
+        build_exact_slots() {
+            size_t num_slots = 2;
+            while (num_slots < 2 * index_ids.size())
+                num_slots *= 2;
+
+            vector<uint32_t> slots(num_slots, 0);
+            for(unsigned int doc = 0; doc < index_ids.size(); doc++) {
+                size_t slot = text_hash(get_index_text(doc)) & (num_slots - 1);
+                while (slots[slot])
+                    slot = (slot + 1) & (num_slots - 1);
+                slots[slot] = doc + 1;
+            }
+            exact_slots.assign(std::move(slots));
+        }
+
+        // Replace results with the documents whose text is exactly query_string, at full confidence and in
+        // document order. Returns whether there are any.
+        bool
+        find_exact(const string &query_string, char source, vector<IndexResult> &results,
+                   vector<ScoredDoc> &hits) const {
+            hits.clear();
+            size_t mask = exact_slots.size() - 1;
+            size_t slot = text_hash(query_string) & mask;
+            // Bounded by the table size, so that a damaged index file can't make this loop forever
+            for(size_t probes = 0; probes < exact_slots.size() && exact_slots[slot]; probes++) {
+                unsigned int doc = exact_slots[slot] - 1;
+                if (doc < index_ids.size() && !is_removed(doc) && get_index_text(doc) == query_string)
+                    hits.push_back({ 1.0f, doc });
+                slot = (slot + 1) & mask;
+            }
+            sort(hits.begin(), hits.end(), [](const ScoredDoc &a, const ScoredDoc &b) {
+                return a.doc < b.doc;
+            });
+            for(unsigned int i = 0; i < delta_texts.size(); i++)
+                if (delta_texts[i] == query_string && !is_removed(index_ids.size() + i))
+                    hits.push_back({ 1.0f, (unsigned int)index_ids.size() + i });
+            if (hits.size() > MAX_FUZZY_SEARCH_RESULTS)
+                hits.resize(MAX_FUZZY_SEARCH_RESULTS);
+
+            results.clear();
+            for(auto &hit : hits)
+                results.push_back(IndexResult(document_id(hit.doc), hit.doc, 1.0, source));
+            // Exact matches never get to select_results(), which counts the searches with this many ties
+            if (results.size() >= NUM_FUZZY_SEARCH_RESULTS)
+                expansion_count++;
+            return results.size() > 0;
+        }
+
+        // The confidence of a text that is dist edits away from a query of the given length
+        static float
+        edit_confidence(size_t dist, size_t query_length) {
+            if (dist == 0)
+                return 1.0;
+            return 1.0 - fabs((float)dist / query_length);
+        }
+
+        // The largest distance whose confidence still reaches min_confidence
+        static size_t
+        max_edit_distance(size_t query_length, float min_confidence) {
+            if (min_confidence <= 0.0)
+                return SIZE_MAX;
+            size_t max_distance = 0;
+            while (edit_confidence(max_distance + 1, query_length) >= min_confidence)
+                max_distance++;
+            return max_distance;
+        }
+
+        // Index the texts for search_long_query(), whenever they change
+        void
+        build_long_text_filter() {
+            long_texts_by_codepoint = !is_ascii_text(string_view(text_arena.data(), text_arena.size()));
+            if (long_texts_by_codepoint) {
+                vector<uint32_t> scratch;
+                long_text_filter.build(index_ids.size(), [&](size_t doc) { return document_codepoints(doc, scratch); });
+            }
+            else
+                long_text_filter.build(index_ids.size(), [this](size_t doc) { return get_index_text(doc); });
+        }
+
+        // The code points of a document, decoded into scratch
+        span<const uint32_t>
+        document_codepoints(unsigned int doc, vector<uint32_t> &scratch) const {
+            scratch.clear();
+            append_codepoints(get_index_text(doc), scratch);
+            return span<const uint32_t>(scratch);
+        }
+
+        // Query strings longer than MAX_ENCODED_STRING_LENGTH are matched by edit distance against the full
+        // texts, as the TF-IDF vectors only cover the start of them. The q-gram filter leaves only the texts
+        // that can come within min_confidence, and only those are compared.
+        //
+        // Where the query or the index has text that isn't ASCII, distances and lengths are counted in code
+        // points. For ASCII on both sides that comes to the same as counting bytes.
+        void
+        search_long_query(const string &query_string, float min_confidence, char source, vector<IndexResult> &results,
+                          FuzzySearchContext &ctx) const {
+            bool by_codepoint = long_texts_by_codepoint || !is_ascii_text(query_string);
+            size_t n = query_string.size();
+            if (by_codepoint) {
+                ctx.query_codepoints.clear();
+                append_codepoints(query_string, ctx.query_codepoints);
+                n = ctx.query_codepoints.size();
+            }
+            size_t max_distance = max_edit_distance(n, min_confidence);
+
+            if (long_texts_by_codepoint)
+                long_text_filter.candidates(span<const uint32_t>(ctx.query_codepoints), max_distance,
+                                            [&](size_t doc) { return document_codepoints(doc, ctx.text_codepoints); },
+                                            ctx.qgrams, ctx.candidates);
+            else {
+                // Characters beyond ASCII can't match ASCII texts, and cost as many byte edits as they have bytes
+                size_t byte_distance = max_distance == SIZE_MAX ? SIZE_MAX : max_distance + query_string.size() - n;
+                long_text_filter.candidates(query_string, byte_distance, [this](size_t doc) { return get_index_text(doc); },
+                                            ctx.qgrams, ctx.candidates);
+            }
+            // Added documents aren't in the filter, there are few enough of them to compare them all
+            for(unsigned int i = 0; i < delta_texts.size(); i++)
+                ctx.candidates.push_back(index_ids.size() + i);
+
+            ctx.hits.clear();
+            if (by_codepoint)
+                ctx.pattern.set(n, ctx.query_codepoints.data());
+            else
+                ctx.pattern.set(n, (const lev_byte*)query_string.c_str());
+            for(unsigned int doc : ctx.candidates) {
+                if (is_removed(doc))
+                    continue;
+                size_t dist;
+                if (by_codepoint) {
+                    auto text = document_codepoints(doc, ctx.text_codepoints);
+                    dist = ctx.pattern.distance(text.size(), text.data(), max_distance);
+                }
+                else {
+                    string_view text = get_index_text(doc);
+                    dist = ctx.pattern.distance(text.size(), (const lev_byte*)text.data(), max_distance);
+                }
+                float conf = edit_confidence(dist, n);
+                if (conf >= min_confidence)
+                    ctx.hits.push_back({ conf, doc });
+            }
+            select_results(ctx.hits, min_confidence);
+
+            results.clear();
+            for(auto &hit : ctx.hits)
+                results.push_back(IndexResult(document_id(hit.doc), hit.doc, hit.score, source));
+        }
+
+        // Fill query with the terms of query_string, using ctx.features as scratch. words may hold the words of
+        // query_string cut to MAX_ENCODED_STRING_LENGTH, if they have been counted already.
+        void
+        vectorize_query(const string &query_string, vector<QueryTerm> &query, FuzzySearchContext &ctx,
+                        const DocumentWords *words = nullptr) const {
+            const TfIdfVectorizer &vectorizer = get_vectorizer();
+            if (words && words->ngram_size == vectorizer.get_ngram_size())
+                vectorizer.transform_words(*words, ctx.features);
+            else
+                vectorizer.transform_query(string_view(query_string).substr(0, MAX_ENCODED_STRING_LENGTH), ctx.features);
+
+            query.clear();
+            for(auto &it : ctx.features) {
+                // Trigrams that no document of the index has can't contribute anything
+                unsigned int term = feature_term(it.first);
+                if (term == UINT_MAX || it.second <= 0.0)
+                    continue;
+                float weight = it.second;
+                query.push_back({ term, weight, weight * term_max_weights[term] });
+            }
+        }
+
+        // Galloping search for the first posting at or after pos whose document is >= doc
+        static unsigned int
+        seek_posting(const unsigned int *ids, unsigned int pos, unsigned int end, unsigned int doc) {
+            unsigned int step = 1;
+            unsigned int lo = pos;
+            while (pos < end && ids[pos] < doc) {
+                lo = pos + 1;
+                pos += step;
+                step <<= 1;
+            }
+            return lower_bound(ids + lo, ids + min(pos, end), doc) - ids;
+        }
+
+        // Raise the threshold to the k-th best score among candidates that can no longer become perfect
+        // matches. Scores passed in are lower bounds of the final scores, so a document whose upper bound
+        // stays below this value is beaten by k non-perfect matches and can't make the results.
+        static float
+        next_tier_threshold(const vector<ScoredDoc> &hits, float remaining, unsigned int k, float threshold,
+                            vector<float> &scores) {
+            scores.clear();
+            for(auto &hit : hits)
+                if (hit.score + remaining < PERFECT_MATCH_CONFIDENCE)
+                    scores.push_back(hit.score);
+            if (scores.size() < k)
+                return threshold;
+
+            nth_element(scores.begin(), scores.begin() + (k - 1), scores.end(), greater<float>());
+            return max(threshold, scores[k - 1]);
+        }
+
+        // Order the query terms by decreasing upper bound and fill remaining[i] with the sum of the bounds
+        // of terms i and later. Returns the number of essential terms: once the remaining bounds add up to
+        // less than min_confidence, those terms can no longer introduce a new document into the results.
+        static size_t
+        prepare_query(vector<QueryTerm> &query, float min_confidence, vector<float> &remaining) {
+            sort(query.begin(), query.end(), [](const QueryTerm &a, const QueryTerm &b) {
+                return a.bound > b.bound;
+            });
+            remaining.assign(query.size() + 1, 0.0);
+            for(int i = (int)query.size() - 1; i >= 0; i--)
+                remaining[i] = remaining[i + 1] + query[i].bound;
+
+            size_t essential = 0;
+            while (essential < query.size() && remaining[essential] >= min_confidence - SCORE_BOUND_EPSILON)
+                essential++;
+            return essential;
+        }
+
+        // Add the contribution of a term to candidates, which must be sorted by document, galloping
+        // through the posting list so that it is walked forward only once.
+        void
+        probe_term(const QueryTerm &qt, vector<ScoredDoc> &hits) const {
+            unsigned int pos = posting_offsets[qt.term];
+            unsigned int end = posting_offsets[qt.term + 1];
+            for(auto &hit : hits) {
+                pos = seek_posting(posting_ids.data(), pos, end, hit.doc);
+                if (pos == end)
+                    break;
+                if (posting_ids[pos] == hit.doc)
+                    hit.score = fmaf(qt.weight, posting_weights[pos], hit.score);
+            }
+        }
+
+        // Term-at-a-time MaxScore: only postings of essential terms create candidates, the remaining
+        // terms are probed for the candidates that can still make the results.
+        //
+        // Every perfect match is collected, plus the best NUM_FUZZY_SEARCH_RESULTS of the rest, in a
+        // single traversal. hits is returned sorted by decreasing score.
+        void
+        score_query(vector<QueryTerm> &query, float min_confidence, vector<ScoredDoc> &hits, FuzzySearchContext &ctx) const {
+            size_t essential = prepare_query(query, min_confidence, ctx.remaining);
+            const vector<float> &remaining = ctx.remaining;
+            vector<float> &accumulator = ctx.accumulator;
+            vector<unsigned int> &candidates = ctx.candidates;
+
+            hits.clear();
+            candidates.clear();
+            float threshold = min_confidence - SCORE_BOUND_EPSILON;
+
+            if (accumulator.size() < index_ids.size())
+                accumulator.resize(index_ids.size(), 0.0);
+
+            const ScoreKernels &kernels = score_kernels();
+            for(size_t i = 0; i < essential; i++) {
+                unsigned int begin = posting_offsets[query[i].term];
+                unsigned int end = posting_offsets[query[i].term + 1];
+                size_t num_candidates = candidates.size();
+                candidates.resize(num_candidates + end - begin);
+                num_candidates += kernels.accumulate_postings(accumulator.data(), posting_ids.data() + begin,
+                                                              posting_weights.data() + begin, end - begin,
+                                                              query[i].weight, candidates.data() + num_candidates);
+                candidates.resize(num_candidates);
+            }
+
+            // Collect the partial scores, leaving the accumulator zeroed for the next search
+            hits.resize(candidates.size());
+            hits.resize(kernels.collect_scores(accumulator.data(), candidates.data(), candidates.size(),
+                                               remaining[essential], threshold, hits.data()));
+            remove_deleted(hits);
+
+            sort(hits.begin(), hits.end(), [](const ScoredDoc &a, const ScoredDoc &b) {
+                return a.doc < b.doc;
+            });
+            for(size_t i = essential; i <= query.size(); i++) {
+                threshold = next_tier_threshold(hits, remaining[i], NUM_FUZZY_SEARCH_RESULTS, threshold, ctx.scores);
+                hits.erase(remove_if(hits.begin(), hits.end(), [&](const ScoredDoc &hit) {
+                    return hit.score + remaining[i] < threshold - SCORE_BOUND_EPSILON;
+                }), hits.end());
+                if (i == query.size() || hits.size() == 0)
+                    break;
+                probe_term(query[i], hits);
+            }
+            score_delta(query, min_confidence, hits);
+            select_results(hits, min_confidence);
+        }
+
+        void
+        remove_deleted(vector<ScoredDoc> &hits) const {
+            if (num_removed == 0)
+                return;
+            hits.erase(remove_if(hits.begin(), hits.end(), [&](const ScoredDoc &hit) {
+                return is_removed(hit.doc);
+            }), hits.end());
+        }
+
+        // Append the delta documents that score at least min_confidence to hits. The delta is expected to
+        // be small, so each document is scored directly, adding the terms up in query order like the
+        // posting list traversal does.
+        void
+        score_delta(const vector<QueryTerm> &query, float min_confidence, vector<ScoredDoc> &hits) const {
+            for(size_t d = 0; d < delta_ids.size(); d++) {
+                unsigned int doc = index_ids.size() + d;
+                if (is_removed(doc))
+                    continue;
+
+                const unsigned int *begin = delta_terms.data() + delta_offsets[d];
+                const unsigned int *end = delta_terms.data() + delta_offsets[d + 1];
+                float score = 0.0;
+                for(auto &qt : query) {
+                    const unsigned int *term = lower_bound(begin, end, qt.term);
+                    if (term != end && *term == qt.term)
+                        score = fmaf(qt.weight, delta_weights[term - delta_terms.data()], score);
+                }
+                if (score >= min_confidence - SCORE_BOUND_EPSILON)
+                    hits.push_back({ score, doc });
+            }
+        }
+
+        // A quantised weight is off by at most this fraction of the largest weight of its term. A uint8
+        // weight that would round to 0 is 1, up to 1/255 more. The smallest half precision weight is too
+        // small to matter beside SCORE_BOUND_EPSILON.
+        float
+        quantisation_error() const {
+            return weight_format == WEIGHT_FORMAT_FP16 ? 1.0 / 2048 : 1.0 / 255;
+        }
+
+        float
+        quantised_weight(unsigned int term, unsigned int pos) const {
+            if (weight_format == WEIGHT_FORMAT_FP16)
+                return half_to_float(posting_weights_fp16[pos]);
+            return posting_weights_uint8[pos] * term_max_weights[term] * (1.0f / 255);
+        }
+
+        static void
+        write_varint(vector<uint8_t> &out, unsigned int value) {
+            for(; value >= 0x80; value >>= 7)
+                out.push_back((value & 0x7f) | 0x80);
+            out.push_back(value);
+        }
+
+        static unsigned int
+        read_varint(const uint8_t *&data) {
+            unsigned int value = 0;
+            for(int shift = 0; ; shift += 7) {
+                uint8_t byte = *data++;
+                value |= (unsigned int)(byte & 0x7f) << shift;
+                if (byte < 0x80)
+                    return value;
+            }
+        }
+
+        // Compress every posting list into blocks of POSTING_BLOCK_SIZE postings. A list of more than one
+        // block starts with a skip table, holding the first document and the offset from the start of the
+        // list of each block as a pair of uint32. A block is its first document as a varint, then if it has
+        // more postings, a byte giving the bit width and the gaps to each next document less one, bit packed.
+        // Last come the weights, as uint8 relative to the largest weight of the term.
+        bool
+        pack_postings() {
+            size_t num_terms = term_max_weights.size();
+            vector<uint32_t> offsets = { 0 };
+            vector<uint8_t> blocks;
+            for(size_t t = 0; t < num_terms; t++) {
+                unsigned int begin = posting_offsets[t], end = posting_offsets[t + 1];
+                size_t num_blocks = (end - begin + POSTING_BLOCK_SIZE - 1) / POSTING_BLOCK_SIZE;
+                size_t start = blocks.size();
+                if (num_blocks > 1)
+                    blocks.resize(start + num_blocks * 2 * sizeof(uint32_t));
+
+                for(size_t b = 0; b < num_blocks; b++) {
+                    unsigned int first = begin + b * POSTING_BLOCK_SIZE;
+                    unsigned int last = min(first + POSTING_BLOCK_SIZE, end);
+                    if (num_blocks > 1) {
+                        uint32_t entry[2] = { posting_ids[first], (uint32_t)(blocks.size() - start) };
+                        memcpy(blocks.data() + start + b * sizeof(entry), entry, sizeof(entry));
+                    }
+
+                    write_varint(blocks, posting_ids[first]);
+                    if (last - first > 1) {
+                        unsigned int max_gap = 0;
+                        for(unsigned int p = first + 1; p < last; p++)
+                            max_gap = max(max_gap, posting_ids[p] - posting_ids[p - 1] - 1);
+                        unsigned int bits = max_gap ? 32 - __builtin_clz(max_gap) : 0;
+                        blocks.push_back(bits);
+
+                        size_t base = blocks.size();
+                        blocks.resize(base + ((size_t)(last - first - 1) * bits + 7) / 8, 0);
+                        for(unsigned int p = first + 1; p < last; p++) {
+                            size_t bit = (size_t)(p - first - 1) * bits;
+                            uint64_t gap = (uint64_t)(posting_ids[p] - posting_ids[p - 1] - 1) << (bit % 8);
+                            for(size_t byte = base + bit / 8; gap; byte++, gap >>= 8)
+                                blocks[byte] |= gap & 0xff;
+                        }
+                    }
+                    for(unsigned int p = first; p < last; p++)
+                        blocks.push_back(quantise_uint8_weight(posting_weights[p], term_max_weights[t]));
+                }
+
+                if (blocks.size() > UINT32_MAX) {
+                    printf("Cannot pack posting lists, they exceed 4GB.\n");
+                    return false;
+                }
+                offsets.push_back(blocks.size());
+            }
+            blocks.resize(blocks.size() + POSTING_BLOCK_PADDING, 0);
+
+            posting_block_offsets.assign(std::move(offsets));
+            posting_blocks.assign(std::move(blocks));
+            posting_ids.assign(vector<unsigned int>());
+            return true;
+        }
+
+        size_t
+        num_posting_blocks(unsigned int term) const {
+            return (posting_offsets[term + 1] - posting_offsets[term] + POSTING_BLOCK_SIZE - 1) / POSTING_BLOCK_SIZE;
+        }
 
-        vector<unsigned int>      index_ids; 
-        vector<string>            index_texts;   // the full text field, needed for matching long query strings
+        // The skip table entry of block b of a packed posting list: its first document and its offset
+        void
+        read_skip_entry(unsigned int term, size_t b, uint32_t entry[2]) const {
+            memcpy(entry, posting_blocks.data() + posting_block_offsets[term] + b * 2 * sizeof(uint32_t),
+                   2 * sizeof(uint32_t));
+        }
+
+        // Whether the packed posting list of term decodes within its own bytes into ascending documents of
+        // the index, which unpack_block() takes for granted
+        bool
+        packed_term_consistent(unsigned int term) const {
+            size_t count = posting_offsets[term + 1] - posting_offsets[term];
+            size_t num_blocks = num_posting_blocks(term);
+            size_t length = posting_block_offsets[term + 1] - posting_block_offsets[term];
+            size_t table = num_blocks > 1 ? num_blocks * 2 * sizeof(uint32_t) : 0;
+            if (length < table)
+                return false;
+
+            const uint8_t *begin = posting_blocks.data() + posting_block_offsets[term], *end = begin + length;
+            uint64_t doc = 0;
+            for(size_t b = 0; b < num_blocks; b++) {
+                size_t n = min((size_t)POSTING_BLOCK_SIZE, count - b * POSTING_BLOCK_SIZE);
+                const uint8_t *data = begin;
+                uint32_t entry[2] = { 0, 0 };
+                if (num_blocks > 1) {
+                    read_skip_entry(term, b, entry);
+                    if (entry[1] < table || entry[1] >= length)
+                        return false;
+                    data += entry[1];
+                }
+
+                uint64_t first = 0;
+                for(int shift = 0; ; shift += 7) {
+                    if (data == end || shift > 28)
+                        return false;
+                    uint8_t byte = *data++;
+                    first |= (uint64_t)(byte & 0x7f) << shift;
+                    if (byte < 0x80)
+                        break;
+                }
+                if ((b > 0 && first <= doc) || (num_blocks > 1 && entry[0] != first))
+                    return false;
+                unsigned int bits = 0;
+                if (n > 1) {
+                    if (data == end || (bits = *data++) > 32)
+                        return false;
+                }
+                size_t gap_bytes = ((n - 1) * bits + 7) / 8;
+                if ((size_t)(end - data) < gap_bytes + n)
+                    return false;
+
+                // Gaps are read a word at a time as unpacking does, which POSTING_BLOCK_PADDING allows
+                doc = first;
+                for(size_t i = 1; i < n; i++) {
+                    size_t bit = (i - 1) * bits;
+                    uint64_t word;
+                    memcpy(&word, data + bit / 8, sizeof(word));
+                    doc += 1 + ((word >> (bit % 8)) & ((1ull << bits) - 1));
+                }
+                if (doc >= index_ids.size())
+                    return false;
+            }
+            return true;
+        }
+
+        // Decode block b of the packed posting list of term into docs and weights. Returns its length.
+        size_t
+        unpack_block(unsigned int term, size_t b, unsigned int *docs, float *weights) const {
+            size_t count = posting_offsets[term + 1] - posting_offsets[term];
+            size_t n = min((size_t)POSTING_BLOCK_SIZE, count - b * POSTING_BLOCK_SIZE);
+            const uint8_t *data = posting_blocks.data() + posting_block_offsets[term];
+            if (count > POSTING_BLOCK_SIZE) {
+                uint32_t entry[2];
+                read_skip_entry(term, b, entry);
+                data += entry[1];
+            }
+
+            unsigned int first = read_varint(data);
+            unsigned int bits = n > 1 ? *data++ : 0;
+            score_kernels().unpack_doc_ids(data, bits, n, first, docs);
+            data += ((n - 1) * bits + 7) / 8;
+            for(size_t i = 0; i < n; i++)
+                weights[i] = data[i] * term_max_weights[term] * (1.0f / 255);
+            return n;
+        }
+
+        // The postings of term with their quantised weights as floats, decoded into ctx. Unless the index
+        // is packed, the ids point into posting_ids.
+        size_t
+        load_term(unsigned int term, FuzzySearchContext &ctx, const unsigned int *&ids, const float *&weights) const {
+            size_t n = posting_offsets[term + 1] - posting_offsets[term];
+            if (ctx.term_weights.size() < n)
+                ctx.term_weights.resize(n);
+            if (weight_format == WEIGHT_FORMAT_PACKED && ctx.term_docs.size() < n)
+                ctx.term_docs.resize(n);
+            ids = decode_term(term, ctx.term_docs.data(), ctx.term_weights.data());
+            weights = ctx.term_weights.data();
+            return n;
+        }
+
+        // Decode the quantised weights of term into weights and, if the index is packed, its ids into docs,
+        // which must have room for all its postings. Returns the ids.
+        const unsigned int *
+        decode_term(unsigned int term, unsigned int *docs, float *weights) const {
+            unsigned int begin = posting_offsets[term];
+            size_t n = posting_offsets[term + 1] - begin;
+            if (weight_format == WEIGHT_FORMAT_PACKED) {
+                for(size_t b = 0, pos = 0; pos < n; b++)
+                    pos += unpack_block(term, b, docs + pos, weights + pos);
+                return docs;
+            }
+            for(size_t i = 0; i < n; i++)
+                weights[i] = quantised_weight(term, begin + i);
+            return posting_ids.data() + begin;
+        }
 
-        FuzzyIndex() :
-     	    vectorizer(false, false) {
+        // Like probe_term(), for a packed posting list. The skip table leads to the one block that can
+        // hold each hit, and blocks that hold none are never decoded.
+        void
+        probe_packed_term(const QueryTerm &qt, vector<ScoredDoc> &hits, FuzzySearchContext &ctx) const {
+            if (ctx.term_docs.size() < POSTING_BLOCK_SIZE)
+                ctx.term_docs.resize(POSTING_BLOCK_SIZE);
+            if (ctx.term_weights.size() < POSTING_BLOCK_SIZE)
+                ctx.term_weights.resize(POSTING_BLOCK_SIZE);
+            unsigned int *docs = ctx.term_docs.data();
+            float *weights = ctx.term_weights.data();
+
+            size_t num_blocks = num_posting_blocks(qt.term);
+            size_t block = 0, decoded = num_blocks;
+            unsigned int pos = 0, n = 0;
+            for(auto &hit : hits) {
+                while (block + 1 < num_blocks) {
+                    uint32_t entry[2];
+                    read_skip_entry(qt.term, block + 1, entry);
+                    if (entry[0] > hit.doc)
+                        break;
+                    block++;
+                }
+                if (decoded != block) {
+                    n = unpack_block(qt.term, block, docs, weights);
+                    decoded = block;
+                    pos = 0;
+                }
+                pos = seek_posting(docs, pos, n, hit.doc);
+                if (pos == n) {
+                    if (block + 1 == num_blocks)
+                        break;
+                    continue;
+                }
+                if (docs[pos] == hit.doc)
+                    hit.score = fmaf(qt.weight, weights[pos], hit.score);
+            }
+        }
+
+        // MaxScore over quantised weights. Every approximate score is within err of the exact one, so with
+        // err as slack the same pruning finds all documents that can make the results. Those are then
+        // rescored exactly from their texts, which gives the scores the float weights would have given.
+        void
+        score_query_quantised(vector<QueryTerm> &query, float min_confidence, vector<ScoredDoc> &hits,
+                              FuzzySearchContext &ctx) const {
+            // The term bounds are exact, so the essential terms are the same as for float weights
+            size_t essential = prepare_query(query, min_confidence, ctx.remaining);
+            const vector<float> &remaining = ctx.remaining;
+            vector<float> &accumulator = ctx.accumulator;
+            vector<unsigned int> &candidates = ctx.candidates;
+
+            hits.clear();
+            candidates.clear();
+            float err = remaining[0] * quantisation_error() + SCORE_BOUND_EPSILON;
+
+            if (accumulator.size() < index_ids.size())
+                accumulator.resize(index_ids.size(), 0.0);
+
+            const ScoreKernels &kernels = score_kernels();
+            for(size_t i = 0; i < essential; i++) {
+                const unsigned int *ids;
+                const float *weights;
+                size_t n = load_term(query[i].term, ctx, ids, weights);
+                size_t num_candidates = candidates.size();
+                candidates.resize(num_candidates + n);
+                num_candidates += kernels.accumulate_postings(accumulator.data(), ids, weights, n, query[i].weight,
+                                                              candidates.data() + num_candidates);
+                candidates.resize(num_candidates);
+            }
+            for(auto doc : candidates) {
+                float partial = accumulator[doc];
+                accumulator[doc] = 0.0;
+                if (partial + remaining[essential] + err >= min_confidence)
+                    hits.push_back({ partial, doc });
+            }
+            remove_deleted(hits);
+
+            sort(hits.begin(), hits.end(), [](const ScoredDoc &a, const ScoredDoc &b) {
+                return a.doc < b.doc;
+            });
+            for(size_t i = essential; i < query.size() && hits.size(); i++) {
+                const QueryTerm &qt = query[i];
+                if (weight_format == WEIGHT_FORMAT_PACKED) {
+                    probe_packed_term(qt, hits, ctx);
+                    continue;
+                }
+                unsigned int pos = posting_offsets[qt.term];
+                unsigned int end = posting_offsets[qt.term + 1];
+                for(auto &hit : hits) {
+                    pos = seek_posting(posting_ids.data(), pos, end, hit.doc);
+                    if (pos == end)
+                        break;
+                    if (posting_ids[pos] == hit.doc)
+                        hit.score = fmaf(qt.weight, quantised_weight(qt.term, pos), hit.score);
+                }
+            }
+            hits.erase(remove_if(hits.begin(), hits.end(), [&](const ScoredDoc &hit) {
+                return hit.score + err < min_confidence;
+            }), hits.end());
+
+            // At most num_results documents are returned, so anything beaten by that many for certain is out
+            const size_t k = NUM_FUZZY_SEARCH_RESULTS;
+            size_t num_perfect = count_if(hits.begin(), hits.end(), [&](const ScoredDoc &hit) {
+                return hit.score + err >= PERFECT_MATCH_CONFIDENCE;
+            });
+            size_t num_results = min((num_perfect / k + 1) * k, (size_t)MAX_FUZZY_SEARCH_RESULTS);
+            if (hits.size() > num_results) {
+                vector<float> &lower = ctx.scores;
+                lower.clear();
+                for(auto &hit : hits)
+                    lower.push_back(hit.score - err);
+                nth_element(lower.begin(), lower.begin() + (num_results - 1), lower.end(), greater<float>());
+                float cutoff = lower[num_results - 1];
+                hits.erase(remove_if(hits.begin(), hits.end(), [&](const ScoredDoc &hit) {
+                    return hit.score + err < cutoff;
+                }), hits.end());
+            }
 
-            similarity::initLibrary(0, LIB_LOGNONE, NULL);
-            space = similarity::SpaceFactoryRegistry<float>::Instance().CreateSpace("negdotprod_sparse_fast",
-                                                                                    similarity::AnyParams());
+            rescore_exact(query, hits, ctx);
+            score_delta(query, min_confidence, hits);
+            select_results(hits, min_confidence);
+        }
+
+        // Recompute the scores of hits from the TF-IDF vectors of their texts, adding the terms up in the
+        // same order as score_query() does
+        void
+        rescore_exact(const vector<QueryTerm> &query, vector<ScoredDoc> &hits, FuzzySearchContext &ctx) const {
+            vector<pair<size_t, double>> &features = ctx.features;
+            for(auto &hit : hits) {
+                get_vectorizer().transform_query(get_index_text(hit.doc).substr(0, MAX_ENCODED_STRING_LENGTH), features,
+                                                 unknown_term_idf);
+                float score = 0.0;
+                for(auto &qt : query) {
+                    size_t feature = term_feature(qt.term);
+                    auto it = lower_bound(features.begin(), features.end(), feature, [](const pair<size_t, double> &f, size_t feature) {
+                        return f.first < feature;
+                    });
+                    if (it != features.end() && it->first == feature)
+                        score = fmaf(qt.weight, (float)it->second, score);
+                }
+                hit.score = score;
+            }
+        }
+
+        // Drop hits below min_confidence and sort the rest by decreasing score. The result count matches what
+        // the old k += 10 re-query loop arrived at: all perfect matches, filled up to the next multiple of
+        // NUM_FUZZY_SEARCH_RESULTS with the next best tier.
+        void
+        select_results(vector<ScoredDoc> &hits, float min_confidence) const {
+            const size_t k = NUM_FUZZY_SEARCH_RESULTS;
+
+            hits.erase(remove_if(hits.begin(), hits.end(), [&](const ScoredDoc &hit) {
+                return hit.score < min_confidence;
+            }), hits.end());
+            sort(hits.begin(), hits.end(), [](const ScoredDoc &a, const ScoredDoc &b) {
+                return a.score > b.score || (a.score == b.score && a.doc < b.doc);
+            });
+
+            size_t num_perfect = 0;
+            while (num_perfect < hits.size() && hits[num_perfect].score >= PERFECT_MATCH_CONFIDENCE)
+                num_perfect++;
+            if (num_perfect >= k)
+                expansion_count++;
+            size_t num_results = min((num_perfect / k + 1) * k, (size_t)MAX_FUZZY_SEARCH_RESULTS);
+            if (hits.size() > num_results)
+                hits.resize(num_results);
+        }
+
+        void
+        make_results(const string &query_string, const vector<ScoredDoc> &hits, float min_confidence, char source,
+                     vector<IndexResult> &results, FuzzySearchContext &ctx) const {
+            results.clear();
+
+            bool has_long = false;
+            for(auto &hit : hits) {
+                if (get_index_text(hit.doc).size() > MAX_ENCODED_STRING_LENGTH)
+                    has_long = true;
+                results.push_back(IndexResult(document_id(hit.doc), hit.doc, hit.score, source));
+            }
+            
+            if (has_long)
+                post_process_long_query(query_string, results, min_confidence, ctx);
+        }
+
+        // Number of searches that the old k += 10 re-query loop would have had to repeat
+        static inline atomic<unsigned long> expansion_count = 0;
+
+    public:
+
+        FlatArray<unsigned int>   index_ids; 
+
+        // Documents are split into words of ngram_size characters, see TfIdfVectorizer
+        FuzzyIndex(unsigned int ngram_size = 3) :
+     	    vectorizer(false, false, true, -1, "l2", false, ngram_size), has_shared_vocabulary(false), vocabulary_fingerprint(0), weight_format(WEIGHT_FORMAT_FLOAT), long_texts_by_codepoint(false), delta_offsets(1, 0), unknown_term_idf(0.0),
+            num_removed(0) {
         }
         
         ~FuzzyIndex() {
-            for(auto &obj : vectorized_data)
-                delete obj;
-            delete index;
-            delete space;
         }
         
-        string
-        get_index_text(unsigned int offset) {
-            if (offset >= index_texts.size()) {
-                printf("ERROR: get_index_text offset %u out of bounds (size: %zu)\n", offset, index_texts.size());
+        static unsigned long
+        get_expansion_count() {
+            return expansion_count;
+        }
+
+        // The returned view points into the index and stays valid until its documents change
+        string_view
+        get_index_text(unsigned int offset) const {
+            if (offset >= index_ids.size()) {
+                if (offset - index_ids.size() < delta_texts.size())
+                    return delta_texts[offset - index_ids.size()];
+                printf("ERROR: get_index_text offset %u out of bounds (size: %zu)\n", offset, index_ids.size());
                 fflush(stdout);
                 return "";
             }
-            return index_texts[offset];
+            return string_view(text_arena.data() + text_offsets[offset], text_offsets[offset + 1] - text_offsets[offset]);
         }
 
+        // Build the index from scratch, vectorising the texts with num_threads threads
         void
-        transform_text(const arma::sp_mat &matrix, similarity::ObjectVector &data) {
-            std::vector<similarity::SparseVectElem<float>> sparse_items;            
-            auto sparse_space = reinterpret_cast<const similarity::SpaceSparseVector<float>*>(space);
-           
-            arma::uword last_col = 0;
-            for(arma::sp_mat::const_iterator it = matrix.begin(); it != matrix.end(); ++it) {
-                if (it.col() != last_col) {
-                    std::sort(sparse_items.begin(), sparse_items.end());
-                    data.push_back(sparse_space->CreateObjFromVect(it.col()-1, -1, sparse_items));
-                    sparse_items.clear();
-                }
-                sparse_items.push_back(similarity::SparseVectElem<float>(it.row(), *it));
-                last_col = it.col();
-            }
-            std::sort(sparse_items.begin(), sparse_items.end());
-            data.push_back(sparse_space->CreateObjFromVect(last_col, -1, sparse_items));
-            sparse_items.clear();
+        build(vector<unsigned int> &_index_ids, vector<string> &text_data, unsigned int num_threads = 1) {
+            build(_index_ids, text_data, nullptr, num_threads);
         }
 
+        // Build the index with the given vocabulary and idf instead of fitting its own to the texts. Many
+        // small indexes can share one vocabulary this way, which is then neither copied nor saved with them.
+        // A null vocabulary fits one for the index as above.
         void
-        build(vector<unsigned int> &_index_ids, vector<string> &text_data) {
+        build(vector<unsigned int> &_index_ids, vector<string> &text_data,
+              shared_ptr<const TfIdfVectorizer> vocabulary, unsigned int num_threads = 1) {
             
             if (text_data.size() == 0)
                 throw std::length_error("no index data provided.");
             if (text_data.size() != _index_ids.size())
                 throw std::length_error("Length of ids and text vectors differs!");
 
+            clear();
+
             // Make a copy, I hope, of the index id data and hold on to it
-            index_ids = _index_ids; 
-            index_texts = text_data;
-            vector<string> short_texts;
+            index_ids.assign(vector<unsigned int>(_index_ids)); 
+
+            size_t arena_size = 0;
             for(auto & it : text_data)
-                short_texts.push_back(it.substr(0, MAX_ENCODED_STRING_LENGTH));
-           
-            arma::sp_mat matrix = vectorizer.fit_transform(short_texts);
-            transform_text(matrix, vectorized_data);
-            
-            index = similarity::MethodFactoryRegistry<float>::Instance().CreateMethod(false,
-                        "simple_invindx",
-                        "negdotprod_sparse_fast",
-                         *space,
-                         vectorized_data);
-            similarity::AnyParams index_params;
+                arena_size += it.size();
+            if (arena_size > UINT32_MAX)
+                throw std::length_error("Index text data exceeds 4GB.");
+            vector<char> arena;
+            vector<uint32_t> offsets = { 0 };
+            arena.reserve(arena_size);
+            offsets.reserve(text_data.size() + 1);
+            for(auto & it : text_data) {
+                arena.insert(arena.end(), it.begin(), it.end());
+                offsets.push_back(arena.size());
+            }
+            text_arena.assign(std::move(arena));
+            text_offsets.assign(std::move(offsets));
+            build_exact_slots();
+            build_long_text_filter();
+
+            // Vectorise straight out of the arena, with no copies of the texts
+            auto document = [this](size_t doc) {
+                return get_index_text(doc).substr(0, MAX_ENCODED_STRING_LENGTH);
+            };
+            if (vocabulary) {
+                has_shared_vocabulary = true;
+                shared_vectorizer = vocabulary;
+                vocabulary_fingerprint = vocabulary->fingerprint();
+            }
+            else
+                vectorizer.fit(index_ids.size(), document, num_threads);
+            unknown_term_idf = get_vectorizer().max_idf();
 
-            index->CreateIndex(index_params);
+            vector<unsigned int> term_offsets, ids;
+            vector<float> weights;
+            get_vectorizer().transform_postings(index_ids.size(), document, term_offsets, ids, weights, num_threads,
+                                                unknown_term_idf);
+            set_postings(std::move(term_offsets), std::move(ids), std::move(weights));
         }
 
-        vector<IndexResult> *
-        search(const string &query_string, float min_confidence, char source) {
-            vector<string> text_data;
-            similarity::ObjectVector data;
-            vector<IndexResult> *results = new vector<IndexResult>;
-            
-            if (index == nullptr) {
+        // Whether the index was built against a shared vocabulary that hasn't been given to it since it was loaded
+        bool
+        needs_vocabulary() const {
+            return has_shared_vocabulary && !shared_vectorizer;
+        }
+
+        // Give a loaded index the shared vocabulary it was built with. Returns false, leaving the index
+        // without one, if the vocabulary is another one or lacks features that the index has.
+        bool
+        use_vocabulary(shared_ptr<const TfIdfVectorizer> vocabulary) {
+            if (!has_shared_vocabulary)
+                return true;
+            if (vocabulary && vocabulary->fingerprint() != vocabulary_fingerprint) {
+                printf("Index was built with another vocabulary.\n");
+                return false;
+            }
+            if (vocabulary && term_features.size() && term_features.back() >= vocabulary->num_features()) {
+                printf("Index has features beyond its vocabulary of %zu.\n", vocabulary->num_features());
+                return false;
+            }
+            shared_vectorizer = vocabulary;
+            unknown_term_idf = vocabulary ? vocabulary->max_idf() : 0.0;
+            return true;
+        }
+
+        // Replace the float posting weights with half precision or 8 bit ones, which take a half or a quarter
+        // of the memory. Packing also compresses the document ids, see pack_postings(). Searches rescore
+        // their final candidates exactly, so the results do not change. Returns whether the weights are in
+        // format now; if they can't be converted, the index keeps the weights it had.
+        bool
+        quantise_weights(int format) {
+            if (weight_format != WEIGHT_FORMAT_FLOAT || format == WEIGHT_FORMAT_FLOAT)
+                return weight_format == format;
+
+            if (format == WEIGHT_FORMAT_FP16) {
+                vector<uint16_t> weights(posting_weights.size());
+                for(size_t p = 0; p < posting_weights.size(); p++)
+                    weights[p] = quantise_fp16_weight(posting_weights[p]);
+                posting_weights_fp16.assign(std::move(weights));
+            }
+            else if (format == WEIGHT_FORMAT_UINT8) {
+                vector<uint8_t> weights(posting_weights.size());
+                for(size_t t = 0; t < term_max_weights.size(); t++)
+                    for(unsigned int p = posting_offsets[t]; p < posting_offsets[t + 1]; p++)
+                        weights[p] = quantise_uint8_weight(posting_weights[p], term_max_weights[t]);
+                posting_weights_uint8.assign(std::move(weights));
+            }
+            else if (format != WEIGHT_FORMAT_PACKED || !pack_postings())
+                return false;
+
+            posting_weights.assign(vector<float>());
+            weight_format = format;
+            return true;
+        }
+
+        // Search for query_string, replacing the contents of results. All scratch memory comes from ctx,
+        // so searches that reuse both results and ctx don't allocate once those have grown to fit.
+        //
+        // If documents have exactly the text of query_string, only those are returned, at confidence 1.0, and
+        // nothing is scored. Pass fuzzy_alternatives to get the scored results regardless, which then include
+        // the exact matches too. Returns true if the results are exact matches only.
+        bool
+        search(const string &query_string, float min_confidence, char source, vector<IndexResult> &results,
+               FuzzySearchContext &ctx, bool fuzzy_alternatives = false) const {
+            return search(query_string, nullptr, min_confidence, source, results, ctx, fuzzy_alternatives);
+        }
+
+        // The same, with the words of query_string cut to MAX_ENCODED_STRING_LENGTH counted beforehand, which
+        // saves counting them again for every index the query is searched in
+        bool
+        search(const string &query_string, const DocumentWords *words, float min_confidence, char source,
+               vector<IndexResult> &results, FuzzySearchContext &ctx, bool fuzzy_alternatives = false) const {
+            shared_lock<shared_mutex> lock(update_mutex);
+            if (posting_offsets.size() == 0) {
                 printf("No index available.\n");
                 fflush(stdout);
-                return nullptr;
+                results.clear();
+                return false;
             }
 
-            text_data.push_back(query_string.substr(0, MAX_ENCODED_STRING_LENGTH));
-            arma::sp_mat matrix = vectorizer.transform(text_data);
-            transform_text(matrix, data);
+            if (!fuzzy_alternatives && find_exact(query_string, source, results, ctx.hits))
+                return true;
+            if (query_string.size() > MAX_ENCODED_STRING_LENGTH) {
+                search_long_query(query_string, min_confidence, source, results, ctx);
+                return false;
+            }
 
-            unsigned k = NUM_FUZZY_SEARCH_RESULTS;
-            bool has_long = false;
-            const unsigned max_k = 1000; // Reasonable upper limit to prevent infinite growth
-
-            // Keep searching with increasing k until we get some non-perfect matches
-            while (k <= max_k) {
-                similarity::KNNQuery<float> knn(*space, data[0], k);
-                index->Search(&knn, -1);
-
-                bool found_non_perfect = false;
-                results->clear(); // Clear previous results
-                has_long = false; // Reset for each iteration
-                
-                auto queue = knn.Result()->Clone();
-                while (!queue->Empty()) {
-                    auto dist = -queue->TopDistance();
-                    if (dist >= min_confidence) {
-                        if (index_texts[queue->TopObject()->id()].size() > MAX_ENCODED_STRING_LENGTH)
-                            has_long = true;
-                        results->push_back(IndexResult(index_ids[queue->TopObject()->id()], queue->TopObject()->id(), dist, source));
-                        
-                        // Check if this result has confidence < 1.0
-                        if (dist < 1.0) {
-                            found_non_perfect = true;
-                        }
-                    }
-                    queue->Pop();
+            vectorize_query(query_string, ctx.query, ctx, words);
+            if (weight_format == WEIGHT_FORMAT_FLOAT)
+                score_query(ctx.query, min_confidence, ctx.hits, ctx);
+            else
+                score_query_quantised(ctx.query, min_confidence, ctx.hits, ctx);
+            make_results(query_string, ctx.hits, min_confidence, source, results, ctx);
+            return false;
+        }
+
+        // Convenience wrapper that returns a new result vector, which the caller must delete
+        vector<IndexResult> *
+        search(const string &query_string, float min_confidence, char source, bool fuzzy_alternatives = false) const {
+            static thread_local FuzzySearchContext ctx;
+            vector<IndexResult> *results = new vector<IndexResult>;
+            search(query_string, min_confidence, source, *results, ctx, fuzzy_alternatives);
+            return results;
+        }
+
+        // Rescore results by edit distance against the full texts, in place. Results below min_confidence
+        // are dropped and the rest come out in reverse order. Short queries get here when they match the
+        // start of a long text, long ones are compared by search_long_query(). Like there, distances are
+        // counted in code points if the query or a text isn't ASCII.
+        void
+        post_process_long_query(const string &query, vector<IndexResult> &results, float min_confidence,
+                                FuzzySearchContext &ctx) const {
+            bool by_codepoint = !is_ascii_text(query);
+            for(size_t i = 0; i < results.size() && !by_codepoint; i++)
+                by_codepoint = !is_ascii_text(get_index_text(results[i].result_index));
+
+            size_t n = query.size();
+            if (by_codepoint) {
+                ctx.query_codepoints.clear();
+                append_codepoints(query, ctx.query_codepoints);
+                n = ctx.query_codepoints.size();
+                ctx.pattern.set(n, ctx.query_codepoints.data());
+            }
+            else
+                ctx.pattern.set(n, (const lev_byte*)query.c_str());
+
+            size_t kept = 0, max_distance = max_edit_distance(n, min_confidence);
+            for(size_t i = 0; i < results.size(); i++) {
+                unsigned int index = results[i].result_index;
+                size_t dist;
+                if (by_codepoint) {
+                    auto text = document_codepoints(index, ctx.text_codepoints);
+                    dist = ctx.pattern.distance(text.size(), text.data(), max_distance);
                 }
-                delete queue;
-                
-                // If we found some non-perfect matches, no results at all, or we have results but 
-                // didn't get any new results in this iteration (k exceeds index size), we're done
-                if (found_non_perfect || results->empty() || results->size() < k) {
-                    break;
+                else {
+                    string_view text = get_index_text(index);
+                    dist = ctx.pattern.distance(text.size(), (const lev_byte*)text.data(), max_distance);
+                }
+                float conf = edit_confidence(dist, n);
+
+                if (conf >= min_confidence) {
+                    results[kept] = results[i];
+                    results[kept++].confidence = conf;
                 }
-                
-                // If all results are still perfect matches (1.0), double k and try again
-                k += NUM_FUZZY_SEARCH_RESULTS;
             }
-            for(auto &obj : data)
-                delete obj;
-            
-            reverse(results->begin(), results->end());
-            if (query_string.size() > MAX_ENCODED_STRING_LENGTH || has_long) {
-                auto updated = post_process_long_query(query_string, results, min_confidence, source);
-                delete results;
-                return updated;
+            results.erase(results.begin() + kept, results.end());
+            reverse(results.begin(), results.end());
+        }
+
+        // Add a document without rebuilding the index. It is vectorised with the vocabulary the index was
+        // built with, so trigrams that are new to the index can't be matched until the next full build.
+        // With a shared vocabulary that holds for every trigram no document has yet, until merge_delta().
+        // Returns false if the index has not been built or loaded.
+        bool
+        add_document(unsigned int id, const string &text) {
+            vector<pair<size_t, double>> features;
+
+            unique_lock<shared_mutex> lock(update_mutex);
+            if (posting_offsets.size() == 0) {
+                printf("Cannot add a document, no index available.\n");
+                return false;
             }
+            get_vectorizer().transform_query(string_view(text).substr(0, MAX_ENCODED_STRING_LENGTH), features, unknown_term_idf);
+            for(auto &it : features) {
+                unsigned int term = feature_term(it.first);
+                if (term != UINT_MAX && it.second > 0.0) {
+                    delta_terms.push_back(term);
+                    delta_weights.push_back(it.second);
+                }
+            }
+            delta_offsets.push_back(delta_terms.size());
+            delta_ids.push_back(id);
+            delta_texts.push_back(text);
+            if (tombstones.size())
+                tombstones.push_back(false);
+            return true;
+        }
 
-            return results;
+        // Remove all documents with the given ids. They stop showing up in searches right away and are
+        // dropped from the index by the next merge_delta(). Returns the number of documents removed.
+        size_t
+        remove_documents(const vector<unsigned int> &ids) {
+            unordered_set<unsigned int> remove(ids.begin(), ids.end());
+
+            unique_lock<shared_mutex> lock(update_mutex);
+            size_t num_documents = index_ids.size() + delta_ids.size();
+            tombstones.resize(num_documents, false);
+            size_t count = 0;
+            for(unsigned int doc = 0; doc < num_documents; doc++)
+                if (!tombstones[doc] && remove.count(document_id(doc))) {
+                    tombstones[doc] = true;
+                    count++;
+                }
+            num_removed += count;
+            return count;
         }
-         
-        vector<IndexResult> *
-        post_process_long_query(const string &query, vector<IndexResult> *results, float min_confidence, char source) {
-            vector<IndexResult> *updated = new vector<IndexResult>;
-          
-            for(int i = results->size() - 1; i >= 0; i--) {
-                unsigned int id = (*results)[i].id;
-                unsigned int index = (*results)[i].result_index;
-                size_t dist = lev_edit_distance(query.size(), (const lev_byte*)query.c_str(), 
-                                                index_texts[index].size(), (const lev_byte*)index_texts[index].c_str(), 1);
-                float conf;
-                if (dist == 0)
-                    conf = 1.0;
-                else 
-                    conf = 1.0 - fabs((float)dist / query.size());
 
-                if (conf >= min_confidence) {
-                    IndexResult temp = { id, index, conf, source };
-                    updated->push_back(temp);
+        // All documents that have not been removed, as (id, text) pairs
+        void
+        get_documents(vector<pair<unsigned int, string>> &documents) const {
+            shared_lock<shared_mutex> lock(update_mutex);
+            documents.clear();
+            for(unsigned int doc = 0; doc < index_ids.size() + delta_ids.size(); doc++)
+                if (!is_removed(doc))
+                    documents.push_back({ document_id(doc), string(get_index_text(doc)) });
+        }
+
+        // Number of added and removed documents that merge_delta() has yet to fold in
+        size_t
+        num_pending_changes() const {
+            shared_lock<shared_mutex> lock(update_mutex);
+            return delta_ids.size() + num_removed;
+        }
+
+        // Fold the added documents into the posting lists and drop the removed ones. The new arrays are
+        // built while searches carry on, which only wait for them to be swapped in, so this can run on a
+        // background thread. Changes made in the meantime are left for the next merge.
+        //
+        // All texts are vectorised again with the vocabulary the index was built with, which reproduces
+        // the weights of the existing documents exactly. Idf values are not refreshed; a full build does that.
+        bool
+        merge_delta() {
+            lock_guard<mutex> merge_lock(merge_mutex);
+
+            // Only merges change the base arrays, so past this snapshot they can be read without the lock
+            size_t num_base = index_ids.size(), num_delta;
+            vector<bool> removed;
+            vector<unsigned int> added_ids;
+            vector<string> added_texts;
+            {
+                shared_lock<shared_mutex> lock(update_mutex);
+                if (delta_ids.size() == 0 && num_removed == 0)
+                    return true;
+                num_delta = delta_ids.size();
+                removed = tombstones;
+                added_ids = delta_ids;
+                added_texts = delta_texts;
+            }
+            removed.resize(num_base + num_delta, false);
+
+            vector<unsigned int> ids, renumber(num_base + num_delta, UINT_MAX);
+            vector<char> arena;
+            vector<uint32_t> offsets = { 0 };
+            for(unsigned int doc = 0; doc < num_base + num_delta; doc++) {
+                if (removed[doc])
+                    continue;
+                string_view text = doc < num_base ? get_index_text(doc) : string_view(added_texts[doc - num_base]);
+                if (arena.size() + text.size() > UINT32_MAX) {
+                    printf("Cannot merge index, text data exceeds 4GB.\n");
+                    return false;
+                }
+                renumber[doc] = ids.size();
+                ids.push_back(doc < num_base ? index_ids[doc] : added_ids[doc - num_base]);
+                arena.insert(arena.end(), text.begin(), text.end());
+                offsets.push_back(arena.size());
+            }
+
+            // Vectorise every document straight into posting lists
+            auto document = [&](size_t doc) {
+                return string_view(arena.data() + offsets[doc], offsets[doc + 1] - offsets[doc]).substr(0, MAX_ENCODED_STRING_LENGTH);
+            };
+            vector<unsigned int> term_offsets, postings;
+            vector<float> weights;
+            get_vectorizer().transform_postings(ids.size(), document, term_offsets, postings, weights, 1, unknown_term_idf);
+
+            FuzzyIndex merged;
+            merged.has_shared_vocabulary = has_shared_vocabulary;
+            merged.index_ids.assign(std::move(ids));
+            merged.text_arena.assign(std::move(arena));
+            merged.text_offsets.assign(std::move(offsets));
+            merged.build_exact_slots();
+            merged.build_long_text_filter();
+            merged.set_postings(std::move(term_offsets), std::move(postings), std::move(weights));
+            // The arrays are swapped in below, and only make sense in the format of this index
+            if (!merged.quantise_weights(weight_format)) {
+                printf("Cannot merge index, its weights can't be quantised.\n");
+                return false;
+            }
+
+            unique_lock<shared_mutex> lock(update_mutex);
+            index_ids.swap(merged.index_ids);
+            text_arena.swap(merged.text_arena);
+            text_offsets.swap(merged.text_offsets);
+            exact_slots.swap(merged.exact_slots);
+            term_features.swap(merged.term_features);
+            posting_offsets.swap(merged.posting_offsets);
+            posting_ids.swap(merged.posting_ids);
+            posting_weights.swap(merged.posting_weights);
+            term_max_weights.swap(merged.term_max_weights);
+            posting_weights_fp16.swap(merged.posting_weights_fp16);
+            posting_weights_uint8.swap(merged.posting_weights_uint8);
+            posting_block_offsets.swap(merged.posting_block_offsets);
+            posting_blocks.swap(merged.posting_blocks);
+            long_text_filter.swap(merged.long_text_filter);
+            long_texts_by_codepoint = merged.long_texts_by_codepoint;
+            mapped_file.reset();
+
+            // Carry over what changed during the merge: removals of merged documents and the newer additions
+            size_t num_merged = index_ids.size();
+            vector<bool> new_tombstones(num_merged + delta_ids.size() - num_delta, false);
+            size_t new_removed = 0;
+            for(unsigned int doc = 0; doc < tombstones.size(); doc++) {
+                if (!tombstones[doc])
+                    continue;
+                unsigned int new_doc = doc < num_base + num_delta ? renumber[doc] : num_merged + doc - num_base - num_delta;
+                if (new_doc != UINT_MAX) {
+                    new_tombstones[new_doc] = true;
+                    new_removed++;
                 }
             }
-            return updated;
+            tombstones.swap(new_tombstones);
+            num_removed = new_removed;
+            if (num_removed == 0)
+                vector<bool>().swap(tombstones);
+
+            unsigned int num_features = delta_offsets[num_delta];
+            delta_ids.erase(delta_ids.begin(), delta_ids.begin() + num_delta);
+            delta_texts.erase(delta_texts.begin(), delta_texts.begin() + num_delta);
+            delta_terms.erase(delta_terms.begin(), delta_terms.begin() + num_features);
+            delta_weights.erase(delta_weights.begin(), delta_weights.begin() + num_features);
+            delta_offsets.erase(delta_offsets.begin(), delta_offsets.begin() + num_delta);
+            for(auto &offset : delta_offsets)
+                offset -= num_features;
+            return true;
+        }
+
+        // Write the index in the flat, page aligned layout that load_index_file() can map in place.
+        // Added and removed documents are only saved once merge_delta() has folded them in.
+        bool
+        save_index_file(const string &path) const {
+            if (num_pending_changes()) {
+                printf("Cannot save index file %s with unmerged changes.\n", path.c_str());
+                return false;
+            }
+            if (has_shared_vocabulary) {
+                printf("Cannot save index file %s, its vocabulary is shared.\n", path.c_str());
+                return false;
+            }
+
+            std::stringstream ss;
+            {
+                cereal::BinaryOutputArchive oarchive(ss);
+                oarchive(vectorizer);
+            }
+            string vectorizer_data = ss.str();
+
+            vector<IndexFileData> sections(FUZZY_SECTION_LONG_TEXT_FILTER);
+            sections[FUZZY_SECTION_VECTORIZER] = { vectorizer_data.data(), vectorizer_data.size() };
+            sections[FUZZY_SECTION_INDEX_IDS] = { index_ids.data(), index_ids.size() * sizeof(unsigned int) };
+            sections[FUZZY_SECTION_TEXT_OFFSETS] = { text_offsets.data(), text_offsets.size() * sizeof(uint32_t) };
+            sections[FUZZY_SECTION_TEXTS] = { text_arena.data(), text_arena.size() };
+            sections[FUZZY_SECTION_POSTING_OFFSETS] = { posting_offsets.data(), posting_offsets.size() * sizeof(unsigned int) };
+            sections[FUZZY_SECTION_POSTING_IDS] = { posting_ids.data(), posting_ids.size() * sizeof(unsigned int) };
+            // A packed index stores its blocks in place of the ids and weights
+            if (weight_format == WEIGHT_FORMAT_PACKED) {
+                sections[FUZZY_SECTION_POSTING_IDS] = { posting_block_offsets.data(), posting_block_offsets.size() * sizeof(uint32_t) };
+                sections[FUZZY_SECTION_POSTING_WEIGHTS] = { posting_blocks.data(), posting_blocks.size() };
+            }
+            else if (weight_format == WEIGHT_FORMAT_FP16)
+                sections[FUZZY_SECTION_POSTING_WEIGHTS] = { posting_weights_fp16.data(), posting_weights_fp16.size() * sizeof(uint16_t) };
+            else if (weight_format == WEIGHT_FORMAT_UINT8)
+                sections[FUZZY_SECTION_POSTING_WEIGHTS] = { posting_weights_uint8.data(), posting_weights_uint8.size() };
+            else
+                sections[FUZZY_SECTION_POSTING_WEIGHTS] = { posting_weights.data(), posting_weights.size() * sizeof(float) };
+            sections[FUZZY_SECTION_TERM_MAX_WEIGHTS] = { term_max_weights.data(), term_max_weights.size() * sizeof(float) };
+            uint32_t format = weight_format;
+            sections[FUZZY_SECTION_WEIGHT_FORMAT] = { &format, sizeof(format) };
+            sections[FUZZY_SECTION_EXACT_SLOTS] = { exact_slots.data(), exact_slots.size() * sizeof(uint32_t) };
+            uint32_t by_codepoint = long_texts_by_codepoint;
+            sections[FUZZY_SECTION_LONG_TEXT_FORMAT] = { &by_codepoint, sizeof(by_codepoint) };
+            long_text_filter.sections(sections);
+            return write_index_file(path, sections);
+        }
+
+        // Map an index file written by save_index_file(). All arrays are used in place, so this only
+        // reads the vectorizer. Returns false if the file is missing or invalid.
+        bool
+        load_index_file(const string &path) {
+            auto file = make_shared<MappedIndexFile>();
+            if (!file->open(path))
+                return false;
+
+            // Files written before weights could be quantised have no weight format section
+            weight_format = WEIGHT_FORMAT_FLOAT;
+            if (file->size() > FUZZY_SECTION_WEIGHT_FORMAT && file->section_size(FUZZY_SECTION_WEIGHT_FORMAT) == sizeof(uint32_t))
+                weight_format = *(const uint32_t *)file->section(FUZZY_SECTION_WEIGHT_FORMAT);
+
+            bool ok = file->size() >= FUZZY_SECTION_WEIGHT_FORMAT &&
+                      file->view_section(FUZZY_SECTION_INDEX_IDS, index_ids) &&
+                      file->view_section(FUZZY_SECTION_TEXT_OFFSETS, text_offsets) &&
+                      file->view_section(FUZZY_SECTION_TEXTS, text_arena) &&
+                      file->view_section(FUZZY_SECTION_POSTING_OFFSETS, posting_offsets) &&
+                      file->view_section(FUZZY_SECTION_TERM_MAX_WEIGHTS, term_max_weights);
+            if (weight_format == WEIGHT_FORMAT_PACKED)
+                ok = ok && file->view_section(FUZZY_SECTION_POSTING_IDS, posting_block_offsets) &&
+                           file->view_section(FUZZY_SECTION_POSTING_WEIGHTS, posting_blocks);
+            else
+                ok = ok && file->view_section(FUZZY_SECTION_POSTING_IDS, posting_ids);
+            if (weight_format == WEIGHT_FORMAT_FP16)
+                ok = ok && file->view_section(FUZZY_SECTION_POSTING_WEIGHTS, posting_weights_fp16);
+            else if (weight_format == WEIGHT_FORMAT_UINT8)
+                ok = ok && file->view_section(FUZZY_SECTION_POSTING_WEIGHTS, posting_weights_uint8);
+            else if (weight_format == WEIGHT_FORMAT_FLOAT)
+                ok = ok && file->view_section(FUZZY_SECTION_POSTING_WEIGHTS, posting_weights);
+            if (!ok || !arrays_consistent()) {
+                printf("Index file %s is inconsistent.\n", path.c_str());
+                clear();
+                return false;
+            }
+
+            // Files written before exact matching was added have no hash table, so it is built here
+            if (!file->view_section(FUZZY_SECTION_EXACT_SLOTS, exact_slots) || exact_slots.size() < 2 ||
+                exact_slots.size() < 2 * index_ids.size() || (exact_slots.size() & (exact_slots.size() - 1)) != 0)
+                build_exact_slots();
+
+            // Nor a long text filter, before it was saved
+            if (file->size() < NUM_FUZZY_SECTIONS || file->section_size(FUZZY_SECTION_LONG_TEXT_FORMAT) != sizeof(uint32_t) ||
+                !long_text_filter.view(*file, FUZZY_SECTION_LONG_TEXT_FILTER) || !long_text_filter.consistent(index_ids.size()))
+                build_long_text_filter();
+            else
+                long_texts_by_codepoint = *(const uint32_t *)file->section(FUZZY_SECTION_LONG_TEXT_FORMAT) != 0;
+
+            try {
+                std::stringstream ss;
+                ss.write((const char *)file->section(FUZZY_SECTION_VECTORIZER), file->section_size(FUZZY_SECTION_VECTORIZER));
+                ss.seekg(ios_base::beg);
+                cereal::BinaryInputArchive iarchive(ss);
+                iarchive(vectorizer);
+                has_shared_vocabulary = false;
+                shared_vectorizer.reset();
+                term_features.assign(vector<uint32_t>());
+                unknown_term_idf = vectorizer.max_idf();
+            }
+            catch (std::exception& e) {
+                printf("Cannot load vectorizer from index file %s: %s\n", path.c_str(), e.what());
+                clear();
+                return false;
+            }
+
+            mapped_file = file;
+            return true;
         }
 
         template<class Archive>
         void save(Archive & archive) const
         {
-            vector<uint8_t> index_data;
-            if (index)
-                index->SerializeIndex(index_data, vectorized_data);
-            archive(index_data, vectorizer, index_ids, index_texts); 
+            archive(FUZZY_INDEX_BLOB_MAGIC, FUZZY_INDEX_BLOB_VERSION, vocabulary_fingerprint);
+            archive(vectorizer, index_ids, text_arena, text_offsets, posting_offsets, posting_ids, posting_weights,
+                    term_max_weights, weight_format, posting_weights_fp16, posting_weights_uint8, posting_block_offsets,
+                    posting_blocks, has_shared_vocabulary, term_features, long_text_filter, long_texts_by_codepoint);
         }
       
+        // Throws if the blob has another format or doesn't hold a consistent index, which then stays empty
         template<class Archive>
         void load(Archive & archive)
         {
-            vector<uint8_t> index_data;
-            // Clean up any object we may have
-            for (auto datum : vectorized_data) {
-                delete datum;
-            }
-            vectorized_data.clear();
+            uint32_t magic = 0, version = 0;
+            clear();
+            archive(magic, version);
+            if (magic != FUZZY_INDEX_BLOB_MAGIC || version != FUZZY_INDEX_BLOB_VERSION)
+                throw std::runtime_error("index blob has an old or unknown format, it needs to be built again");
 
-            // Restore our data
-            archive(index_data, vectorizer, index_ids, index_texts); 
-            delete index;
-            
-            
-            if (index_data.size() == 0)
-                return;
-    
-            auto factory = similarity::MethodFactoryRegistry<float>::Instance();
-            index = factory.CreateMethod(false, 
-                                         "simple_invindx",
-                                         "negdotprod_sparse_fast",
-                                         *space, 
-                                         vectorized_data);
-            index->UnserializeIndex(index_data, vectorized_data);
+            archive(vocabulary_fingerprint, vectorizer, index_ids, text_arena, text_offsets, posting_offsets, posting_ids, posting_weights,
+                    term_max_weights, weight_format, posting_weights_fp16, posting_weights_uint8, posting_block_offsets,
+                    posting_blocks, has_shared_vocabulary, term_features, long_text_filter, long_texts_by_codepoint);
+            // An index whose build failed is saved without any documents
+            bool never_built = index_ids.size() == 0 && text_offsets.size() == 0 && posting_offsets.size() == 0;
+            if (!never_built && (!arrays_consistent() || !long_text_filter.consistent(index_ids.size()))) {
+                clear();
+                throw std::runtime_error("index blob is inconsistent, it needs to be built again");
+            }
+            build_exact_slots();
+            shared_vectorizer.reset();
+            unknown_term_idf = has_shared_vocabulary ? 0.0 : vectorizer.max_idf();
         }
 };
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+using namespace std;
+
+// On disk an index file is a header, a table of sections and then the sections themselves. Every
+// section starts on a page boundary, so its flat arrays can be used straight out of a read-only mmap
+// and several processes that map the same file share one copy in the page cache.
+const uint32_t INDEX_FILE_MAGIC = 0x5a46424c;    // "LBFZ"
+const uint32_t INDEX_FILE_VERSION = 3;    // 2: vectorizer vocabulary stored as trigram codes, 3: n-gram size
+const size_t   INDEX_FILE_ALIGNMENT = 4096;
+
+struct IndexFileHeader {
+    uint32_t       magic;
+    uint32_t       version;
+    uint32_t       num_sections;
+    uint32_t       reserved;
+};
+
+struct IndexFileSection {
+    uint64_t       offset;
+    uint64_t       size;
+};
+
+// A section to write: size bytes starting at data
+struct IndexFileData {
+    const void    *data;
+    size_t         size;
+};
+
+// A read-only array that either owns its elements or views elements that live in a mapped index file
+template <typename T>
+class FlatArray {
+    private:
+        vector<T>      owned;
+        const T       *elements;
+        size_t         count;
+
+    public:
+        FlatArray() : elements(nullptr), count(0) {
+        }
+
+        FlatArray(const FlatArray &other) {
+            *this = other;
+        }
+
+        FlatArray &
+        operator=(const FlatArray &other) {
+            if (this == &other)
+                return *this;
+            owned = other.owned;
+            elements = other.owns_data() ? owned.data() : other.elements;
+            count = other.count;
+            return *this;
+        }
+
+        void
+        assign(vector<T> &&values) {
+            owned = std::move(values);
+            elements = owned.data();
+            count = owned.size();
+        }
+
+        void
+        view(const T *data, size_t size) {
+            vector<T>().swap(owned);
+            elements = data;
+            count = size;
+        }
+
+        // Exchange contents without copying, the elements stay where they are
+        void
+        swap(FlatArray &other) {
+            owned.swap(other.owned);
+            std::swap(elements, other.elements);
+            std::swap(count, other.count);
+        }
+
+        bool
+        owns_data() const {
+            return elements == owned.data();
+        }
+
+        size_t       size() const { return count; }
+        const T     *data() const { return elements; }
+        const T     *begin() const { return elements; }
+        const T     *end() const { return elements + count; }
+        const T     &back() const { return elements[count - 1]; }
+        const T     &operator[](size_t i) const { return elements[i]; }
+
+        // Serialised exactly like a vector<T>, so that the blobs written before this class existed still load
+        template<class Archive>
+        void save(Archive & archive) const
+        {
+            vector<T> values(begin(), end());
+            archive(values);
+        }
+
+        template<class Archive>
+        void load(Archive & archive)
+        {
+            vector<T> values;
+            archive(values);
+            assign(std::move(values));
+        }
+};
+
+// Write the given sections to path. The file is written next to its final location and renamed into
+// place, so processes that still have the old file mapped keep a consistent view of it.
+inline bool
+write_index_file(const string &path, const vector<IndexFileData> &sections) {
+    string tmp_path = path + string(".tmp");
+    FILE *fp = fopen(tmp_path.c_str(), "wb");
+    if (fp == nullptr) {
+        printf("Cannot write index file %s: %s\n", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    IndexFileHeader header = { INDEX_FILE_MAGIC, INDEX_FILE_VERSION, (uint32_t)sections.size(), 0 };
+    vector<IndexFileSection> table;
+    uint64_t offset = sizeof(header) + sections.size() * sizeof(IndexFileSection);
+    for(auto &it : sections) {
+        offset = (offset + INDEX_FILE_ALIGNMENT - 1) / INDEX_FILE_ALIGNMENT * INDEX_FILE_ALIGNMENT;
+        table.push_back({ offset, it.size });
+        offset += it.size;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    if (ok && table.size())
+        ok = fwrite(table.data(), sizeof(IndexFileSection), table.size(), fp) == table.size();
+
+    vector<char> padding(INDEX_FILE_ALIGNMENT, 0);
+    uint64_t written = sizeof(header) + sections.size() * sizeof(IndexFileSection);
+    for(size_t i = 0; ok && i < sections.size(); i++) {
+        ok = fwrite(padding.data(), 1, table[i].offset - written, fp) == table[i].offset - written;
+        if (ok && sections[i].size)
+            ok = fwrite(sections[i].data, 1, sections[i].size, fp) == sections[i].size;
+        written = table[i].offset + table[i].size;
+    }
+
+    if (fclose(fp) != 0)
+        ok = false;
+    if (ok && rename(tmp_path.c_str(), path.c_str()) != 0)
+        ok = false;
+    if (!ok) {
+        printf("Failed to write index file %s: %s\n", path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+    }
+    return ok;
+}
+
+// A read-only mapping of an index file written by write_index_file
+class MappedIndexFile {
+    private:
+        void                          *base;
+        size_t                         length;
+        const IndexFileSection        *sections;
+        uint32_t                       num_sections;
+
+    public:
+        MappedIndexFile() : base(nullptr), length(0), sections(nullptr), num_sections(0) {
+        }
+
+        MappedIndexFile(const MappedIndexFile &) = delete;
+        MappedIndexFile &operator=(const MappedIndexFile &) = delete;
+
+        ~MappedIndexFile() {
+            if (base)
+                munmap(base, length);
+        }
+
+        bool
+        open(const string &path) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexFileHeader)) {
+                close(fd);
+                printf("Index file %s is truncated.\n", path.c_str());
+                return false;
+            }
+
+            length = st.st_size;
+            base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (base == MAP_FAILED) {
+                base = nullptr;
+                printf("Cannot map index file %s: %s\n", path.c_str(), strerror(errno));
+                return false;
+            }
+
+            const IndexFileHeader *header = (const IndexFileHeader *)base;
+            if (header->magic != INDEX_FILE_MAGIC || header->version != INDEX_FILE_VERSION) {
+                printf("Index file %s has an unsupported format.\n", path.c_str());
+                return false;
+            }
+            if (sizeof(IndexFileHeader) + header->num_sections * sizeof(IndexFileSection) > length) {
+                printf("Index file %s is truncated.\n", path.c_str());
+                return false;
+            }
+            num_sections = header->num_sections;
+            sections = (const IndexFileSection *)((const char *)base + sizeof(IndexFileHeader));
+            for(uint32_t i = 0; i < num_sections; i++)
+                if (sections[i].offset > length || sections[i].size > length - sections[i].offset) {
+                    printf("Index file %s is truncated.\n", path.c_str());
+                    return false;
+                }
+
+            return true;
+        }
+
+        uint32_t
+        size() const {
+            return num_sections;
+        }
+
+        const void *
+        section(uint32_t i) const {
+            return (const char *)base + sections[i].offset;
+        }
+
+        size_t
+        section_size(uint32_t i) const {
+            return sections[i].size;
+        }
+
+        // Point array at section i, checking that the section holds a whole number of elements
+        template <typename T>
+        bool
+        view_section(uint32_t i, FlatArray<T> &array) const {
+            if (i >= num_sections || sections[i].size % sizeof(T) != 0)
+                return false;
+            array.view((const T *)section(i), sections[i].size / sizeof(T));
+            return true;
+        }
+};
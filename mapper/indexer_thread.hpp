@@ -23,6 +23,21 @@ const char *fetch_pending_artists_query = R"(
              WHERE artist_credit_id > 2 
           GROUP BY artist_credit_id order by cnt desc)";
 
+// Index blobs of artist credits that don't start with the current FuzzyIndex blob header, see
+// FUZZY_INDEX_BLOB_MAGIC. They can't be loaded, so they are deleted and built again.
+const char *delete_stale_blobs_query = R"(
+    DELETE FROM index_cache
+          WHERE entity_id > 0
+            AND substr(index_data, 1, 8) IS NOT ?)";
+
+// Index blobs of artist credits that were built with a global vocabulary other than the one in the index
+// cache, whose fingerprint follows the blob header. It is 0 for indexes with vocabularies of their own.
+const char *delete_other_vocabulary_blobs_query = R"(
+    DELETE FROM index_cache
+          WHERE entity_id > 0
+            AND substr(index_data, 9, 8) IS NOT zeroblob(8)
+            AND substr(index_data, 9, 8) IS NOT ?)";
+
 class CreatorThread {
     public:
         unsigned int     artist_id;
@@ -56,13 +71,15 @@ class IndexerThread {
     private:
         string                  index_dir, db_file;
         int                     num_threads;
+        bool                    global_vocabulary;
 
     public:
 
-        IndexerThread(const string &_index_dir, int _num_threads) { 
+        IndexerThread(const string &_index_dir, int _num_threads, bool _global_vocabulary = false) { 
             index_dir = _index_dir;
             db_file = _index_dir + "/mapping.db";
             num_threads = _num_threads;
+            global_vocabulary = _global_vocabulary;
         }
         
         ~IndexerThread() {
@@ -86,9 +103,31 @@ class IndexerThread {
             try
             {
                 SQLite::Database    db(db_file, SQLite::OPEN_READWRITE);
-                SQLite::Statement   query(db, fetch_pending_artists_query);
 
                 db.exec("PRAGMA journal_mode=WAL;");
+
+                uint32_t header[2] = { FUZZY_INDEX_BLOB_MAGIC, FUZZY_INDEX_BLOB_VERSION };
+                SQLite::Statement   stale(db, delete_stale_blobs_query);
+                stale.bind(1, (const void *)header, (int32_t)sizeof(header));
+                int num_stale = stale.exec();
+                if (num_stale)
+                    log("%d cached indexes have an old format and are built again", num_stale);
+
+                RecordingIndex recording_index(index_dir);
+                recording_index.load_recording_aliases();
+                if (global_vocabulary && !recording_index.use_global_vocabulary(db, num_threads))
+                    log("no global vocabulary, each index gets its own");
+
+                // Whether or not new indexes use it, the ones built with another vocabulary can't be loaded
+                auto vocabulary = RecordingIndex::load_global_vocabulary(db);
+                uint64_t fingerprint = vocabulary ? vocabulary->fingerprint() : 0;
+                SQLite::Statement   other(db, delete_other_vocabulary_blobs_query);
+                other.bind(1, (const void *)&fingerprint, (int32_t)sizeof(fingerprint));
+                num_stale = other.exec();
+                if (num_stale)
+                    log("%d cached indexes were built with another vocabulary and are built again", num_stale);
+
+                SQLite::Statement   query(db, fetch_pending_artists_query);
                 
                 while (query.executeStep())
                     artist_ids.push_back(query.getColumn(0));
@@ -100,9 +139,6 @@ class IndexerThread {
                 unsigned int count = 0;
                 unsigned int total_count = artist_ids.size();
                 
-                RecordingIndex recording_index(index_dir);
-                recording_index.load_recording_aliases();
-                
                 auto now = chrono::system_clock::now();
                 time_t t0 = std::chrono::system_clock::to_time_t(now);
                 log("Using %d threads", num_threads);
@@ -263,6 +263,188 @@ lev_edit_distance(size_t len1, const lev_byte *string1,
     return i;
 }
 
+/* The index of code point c in the table of wide characters: where it is, or
+ * the empty slot where it would go */
+size_t
+LevPattern::wide_slot(uint32_t c) const {
+    size_t mask = wide_chars.size() - 1;
+    size_t slot = (c * (size_t)0x9e3779b1) & mask;
+    while (wide_chars[slot] != c && wide_chars[slot] != 0)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+template <typename Char>
+void
+LevPattern::set_string(size_t len1, const Char *string1) {
+    size_t num_wide = 0;
+
+    len = len1;
+    words = (len1 + 63) / 64;
+    match_masks.assign(256 * words, 0);
+    no_match.assign(words, 0);
+    row.resize(words);
+
+    /* code points from U+0100 on go in an open addressing table, which has
+     * at least twice as many slots as the pattern has characters */
+    for (size_t i = 0; i < len1; i++)
+        num_wide += string1[i] > 0xff;
+    wide_chars.assign(num_wide ? 2 : 0, 0);
+    while (wide_chars.size() && wide_chars.size() < 2 * num_wide)
+        wide_chars.resize(2 * wide_chars.size());
+    wide_masks.assign(wide_chars.size() * words, 0);
+
+    for (size_t i = 0; i < len1; i++) {
+        uint32_t c = string1[i];
+        uint64_t *masks = match_masks.data() + c * words;
+        if (c > 0xff) {
+            size_t slot = wide_slot(c);
+            wide_chars[slot] = c;
+            masks = wide_masks.data() + slot * words;
+        }
+        masks[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+}
+
+/**
+ * LevPattern::set:
+ * @len1: The length of @string1.
+ * @string1: A sequence of bytes of length @len1, may contain NUL characters.
+ *
+ * Prepares @string1 for LevPattern::distance(), reusing the memory of the
+ * previous pattern.
+ **/
+void
+LevPattern::set(size_t len1, const lev_byte *string1) {
+    set_string(len1, string1);
+}
+
+/**
+ * LevPattern::set:
+ * @len1: The length of @string1.
+ * @string1: A sequence of @len1 Unicode code points.
+ *
+ * Prepares @string1 for LevPattern::distance() on code points, so that every
+ * character is one symbol whatever its UTF-8 length.
+ **/
+void
+LevPattern::set(size_t len1, const uint32_t *string1) {
+    set_string(len1, string1);
+}
+
+/* The match masks of character c */
+inline const uint64_t *
+LevPattern::masks(uint32_t c) const {
+    if (c <= 0xff)
+        return match_masks.data() + c * words;
+    if (wide_chars.empty())
+        return no_match.data();
+    size_t slot = wide_slot(c);
+    return wide_chars[slot] == c ? wide_masks.data() + slot * words : no_match.data();
+}
+
+template <typename Char>
+size_t
+LevPattern::lcs_distance(size_t len2, const Char *string2, size_t max_distance) {
+    size_t lcs = 0;
+
+    if (max_distance >= len + len2)
+        max_distance = len + len2;
+    if (len > len2 + max_distance || len2 > len + max_distance)
+        return max_distance + 1;
+    if (len == 0 || len2 == 0)
+        return len + len2;
+
+    /* the distance is within max_distance if the LCS reaches this */
+    size_t needed = (len + len2 - max_distance + 1) / 2;
+
+    /* a zero bit in V marks a pattern position where the LCS grows */
+    if (words == 1) {
+        uint64_t V = ~(uint64_t)0;
+        uint64_t padding = len < 64 ? ~(uint64_t)0 << len : 0;
+        for (size_t j = 0; j < len2; j++) {
+            uint64_t U = V & *masks(string2[j]);
+            V = (V + U) | (V - U);
+            if ((j & 7) == 7 && __builtin_popcountll(~(V | padding)) + len2 - j - 1 < needed)
+                return max_distance + 1;
+        }
+        lcs = __builtin_popcountll(~(V | padding));
+    }
+    else {
+        uint64_t *V = row.data();
+        for (size_t w = 0; w < words; w++)
+            V[w] = ~(uint64_t)0;
+        for (size_t j = 0; j < len2; j++) {
+            const uint64_t *M = masks(string2[j]);
+            uint64_t carry = 0;
+            for (size_t w = 0; w < words; w++) {
+                /* V = (V + U) | (V & ~M), adding across the words */
+                uint64_t U = V[w] & M[w];
+                uint64_t sum = V[w] + U;
+                uint64_t next_carry = sum < U;
+                sum += carry;
+                next_carry |= sum < carry;
+                V[w] = sum | (V[w] & ~M[w]);
+                carry = next_carry;
+            }
+            if ((j & 7) == 7 && pattern_lcs() + len2 - j - 1 < needed)
+                return max_distance + 1;
+        }
+        lcs = pattern_lcs();
+    }
+    if (len + len2 - 2 * lcs > max_distance)
+        return max_distance + 1;
+    return len + len2 - 2 * lcs;
+}
+
+/**
+ * LevPattern::distance:
+ * @len2: The length of @string2.
+ * @string2: A sequence of bytes of length @len2, may contain NUL characters.
+ * @max_distance: The largest distance of interest.
+ *
+ * Computes the edit distance of the pattern to @string2. Every 8 characters
+ * of @string2 the LCS is checked against what the rest of @string2 could
+ * still add to it, and the computation stops once the distance can't be
+ * within @max_distance any more.
+ *
+ * Returns: lev_edit_distance(len1, string1, len2, string2, 1), or
+ *          @max_distance + 1 if that is larger than @max_distance.
+ **/
+size_t
+LevPattern::distance(size_t len2, const lev_byte *string2, size_t max_distance) {
+    return lcs_distance(len2, string2, max_distance);
+}
+
+/**
+ * LevPattern::distance:
+ * @len2: The length of @string2.
+ * @string2: A sequence of @len2 Unicode code points.
+ * @max_distance: The largest distance of interest.
+ *
+ * The same for code points, with a pattern set from code points.
+ *
+ * Returns: lev_u_edit_distance(len1, string1, len2, string2, 1), or
+ *          @max_distance + 1 if that is larger than @max_distance.
+ **/
+size_t
+LevPattern::distance(size_t len2, const uint32_t *string2, size_t max_distance) {
+    return lcs_distance(len2, string2, max_distance);
+}
+
+/* The number of zero bits among the first len bits of row */
+size_t
+LevPattern::pattern_lcs() const {
+    size_t lcs = 0;
+    for (size_t w = 0; w < words; w++) {
+        uint64_t v = row[w];
+        if (w == words - 1 && len % 64)
+            v |= ~(uint64_t)0 << (len % 64);
+        lcs += __builtin_popcountll(~v);
+    }
+    return lcs;
+}
+
 /**
  * editops_from_cost_matrix:
  * @len1: The length of @string1.
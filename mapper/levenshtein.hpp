@@ -14,6 +14,8 @@
 #ifndef size_t
 #  include <stdlib.h>
 #endif
+#include <stdint.h>
+#include <vector>
 
 /* A bit dirty. */
 #ifndef _LEV_STATIC_PY
@@ -109,6 +111,59 @@ lev_u_edit_distance(size_t len1,
                     const lev_wchar *string2,
                     int xcost);
 
+/* One string prepared for computing its edit distance to many others, with
+ * replacements weighing 2 as lev_edit_distance() does with a nonzero xcost.
+ * That distance is len1 + len2 - 2 * LCS, and the length of the longest
+ * common subsequence is computed with Hyyro's bit-parallel recurrence, in
+ * O(len2 * ceil(len1 / 64)) time and with no allocations once set. Given a
+ * max_distance, it gives up as soon as the distance must be larger.
+ *
+ * Strings are bytes or Unicode code points. Code points from U+0100 on find
+ * their match masks in a small hash table rather than the byte table. */
+class LevPattern {
+    private:
+        size_t                  len;
+        size_t                  words;         /* 64 bit words per bit vector */
+        std::vector<uint64_t>   match_masks;   /* bit i of word w of row c is set if string[64 * w + i] == c */
+        std::vector<uint32_t>   wide_chars;    /* code points from U+0100 on, 0 for an empty slot */
+        std::vector<uint64_t>   wide_masks;    /* the match masks of wide_chars, by slot */
+        std::vector<uint64_t>   no_match;      /* the masks of characters the pattern doesn't have */
+        std::vector<uint64_t>   row;           /* the bit vector of the last column */
+
+        size_t
+        wide_slot(uint32_t c) const;
+
+        const uint64_t *
+        masks(uint32_t c) const;
+
+        size_t
+        pattern_lcs() const;
+
+        template <typename Char>
+        void
+        set_string(size_t len1, const Char *string1);
+
+        template <typename Char>
+        size_t
+        lcs_distance(size_t len2, const Char *string2, size_t max_distance);
+
+    public:
+        LevPattern() : len(0), words(0) {
+        }
+
+        void
+        set(size_t len1, const lev_byte *string1);
+
+        void
+        set(size_t len1, const uint32_t *string1);
+
+        size_t
+        distance(size_t len2, const lev_byte *string2, size_t max_distance = SIZE_MAX);
+
+        size_t
+        distance(size_t len2, const uint32_t *string2, size_t max_distance = SIZE_MAX);
+};
+
 LevEditOp*
 lev_editops_find(size_t len1,
                  const lev_byte *string1,
@@ -7,10 +7,13 @@
 #include "SQLiteCpp.h"
 
 void print_usage() {
-    log("Usage: make_indexes [--skip-artists] [--force-rebuild]");
+    log("Usage: make_indexes [--skip-artists] [--update-artists] [--force-rebuild] [--global-vocabulary]");
     log("Options:");
     log("  --skip-artists   Skip building artist indexes");
+    log("  --update-artists Update the existing artist indexes instead of rebuilding them");
     log("  --force-rebuild  Force rebuild all recording indexes (ignore cache)");
+    log("  --global-vocabulary  Build recording indexes with one shared vocabulary and idf. It is fitted");
+    log("                   once and kept until --force-rebuild");
     log("");
     log("Required environment variables:");
     log("  INDEX_DIR                         Directory containing mapping.db");
@@ -18,6 +21,8 @@ void print_usage() {
     log("");
     log("Optional environment variables:");
     log("  NUM_BUILD_THREADS                 Thread count (0 = num CPU cores, default: 0)");
+    log("  INDEX_WEIGHT_FORMAT               Artist index weights: float, fp16, uint8 or packed (default: float)");
+    log("  ARTIST_BUILD_MEMORY               MB the artist index builds may use together (0 = no limit, default: 0)");
 }
 
 int main(int argc, char *argv[])
@@ -26,15 +31,21 @@ int main(int argc, char *argv[])
     load_env_file();  // Load .env file, env vars take precedence
     
     bool skip_artists = false;
+    bool update_artists = false;
     bool force_rebuild = false;
+    bool global_vocabulary = false;
     
     // Parse arguments (options only, no positional arguments)
     for (int i = 1; i < argc; i++) {
         string arg = argv[i];
         if (arg == "--skip-artists") {
             skip_artists = true;
+        } else if (arg == "--update-artists") {
+            update_artists = true;
         } else if (arg == "--force-rebuild") {
             force_rebuild = true;
+        } else if (arg == "--global-vocabulary") {
+            global_vocabulary = true;
         } else if (arg == "--help" || arg == "-h") {
             print_usage();
             return 0;
@@ -61,6 +72,31 @@ int main(int argc, char *argv[])
         num_threads = std::atoi(env_num_threads);
     }
     
+    // Get optional INDEX_WEIGHT_FORMAT from environment
+    int weight_format = WEIGHT_FORMAT_FLOAT;
+    const char* env_weight_format = std::getenv("INDEX_WEIGHT_FORMAT");
+    if (env_weight_format && strlen(env_weight_format) > 0) {
+        string format = env_weight_format;
+        if (format == "fp16")
+            weight_format = WEIGHT_FORMAT_FP16;
+        else if (format == "uint8")
+            weight_format = WEIGHT_FORMAT_UINT8;
+        else if (format == "packed")
+            weight_format = WEIGHT_FORMAT_PACKED;
+        else if (format != "float") {
+            log("Error: INDEX_WEIGHT_FORMAT must be float, fp16, uint8 or packed");
+            return -1;
+        }
+    }
+    
+    // Get optional ARTIST_BUILD_MEMORY from environment
+    size_t artist_build_memory = 0;
+    const char* env_build_memory = std::getenv("ARTIST_BUILD_MEMORY");
+    if (env_build_memory && strlen(env_build_memory) > 0) {
+        long memory = std::atol(env_build_memory);
+        artist_build_memory = memory > 0 ? memory : 0;
+    }
+    
     // Validate CANONICAL_MUSICBRAINZ_DATA_CONNECT is set (needed for artist index building)
     if (!skip_artists) {
         const char* db_connect = std::getenv("CANONICAL_MUSICBRAINZ_DATA_CONNECT");
@@ -77,6 +113,11 @@ int main(int argc, char *argv[])
         print_usage();
         return -1;
     }
+    if (skip_artists && update_artists) {
+        log("Error: --skip-artists and --update-artists cannot be used together");
+        print_usage();
+        return -1;
+    }
    
     // Clear cache if force rebuild is requested
     if (force_rebuild) {
@@ -92,10 +133,22 @@ int main(int argc, char *argv[])
         }
     }
 
+    // 0 means use number of CPU cores
+    num_threads = (num_threads <= 0) ? std::thread::hardware_concurrency() : num_threads;
+    if (num_threads <= 0) num_threads = 4;  // fallback if hardware_concurrency() fails
+
     if (!skip_artists) {
-        log("build artist indexes");
-        ArtistIndex *artist_index = new ArtistIndex(index_dir);
-        artist_index->build();
+        ArtistIndex *artist_index = new ArtistIndex(index_dir, weight_format, num_threads, artist_build_memory);
+        if (update_artists) {
+            log("update artist indexes");
+            update_artists = artist_index->update();
+            if (!update_artists)
+                log("artist indexes could not be updated, rebuilding them");
+        }
+        if (!update_artists) {
+            log("build artist indexes");
+            artist_index->build();
+        }
         // clean up to free memory
         delete artist_index;
     } else {
@@ -103,12 +156,8 @@ int main(int argc, char *argv[])
     }
 
 
-    // 0 means use number of CPU cores
-    num_threads = (num_threads <= 0) ? std::thread::hardware_concurrency() : num_threads;
-    if (num_threads <= 0) num_threads = 4;  // fallback if hardware_concurrency() fails
-                                            //
     log("build recording indexes with %d threads", num_threads);
-    IndexerThread mapping(index_dir, num_threads);
+    IndexerThread mapping(index_dir, num_threads, global_vocabulary);
     mapping.build_recording_indexes();
 
     return 0;
@@ -93,49 +93,13 @@ void MakeMapping::create() {
     
     log("Connecting to PostgreSQL...");
     
-    // Get DB connection string from environment variable
-    const char* db_connect = std::getenv("CANONICAL_MUSICBRAINZ_DATA_CONNECT");
-    if (!db_connect || strlen(db_connect) == 0) {
-        throw std::runtime_error("CANONICAL_MUSICBRAINZ_DATA_CONNECT environment variable not set");
-    }
-    
-    // Connect to PostgreSQL using libpq
-    PGconn *conn = PQconnectdb(db_connect);
-    
-    if (PQstatus(conn) != CONNECTION_OK) {
-        log("Connection to database failed: %s", PQerrorMessage(conn));
-        PQfinish(conn);
-        throw std::runtime_error("PostgreSQL connection failed");
-    }
-    
+    // The rows stream in as the query produces them, the result set is never held in memory
     log("Executing query...");
-    
-    // Start a transaction for the cursor
-    PGresult *result = PQexec(conn, "BEGIN");
-    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
-        log("BEGIN failed: %s", PQerrorMessage(conn));
-        PQclear(result);
-        PQfinish(conn);
-        throw std::runtime_error("PostgreSQL BEGIN failed");
-    }
-    PQclear(result);
-    
-    // Declare a cursor for the big query
-    string cursor_sql = "DECLARE big_cursor CURSOR FOR " + string(MAPPING_QUERY);
-    result = PQexec(conn, cursor_sql.c_str());
-    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
-        log("DECLARE CURSOR failed: %s", PQerrorMessage(conn));
-        PQclear(result);
-        PQfinish(conn);
-        throw std::runtime_error("PostgreSQL DECLARE CURSOR failed");
-    }
-    PQclear(result);
+    PGRowStream rows(MAPPING_QUERY);
     
     log("Writing CSV file...");
     ofstream csvfile(csv_file);
     if (!csvfile.is_open()) {
-        PQclear(result);
-        PQfinish(conn);
         throw std::runtime_error("Failed to open CSV file for writing");
     }
     
@@ -147,101 +111,65 @@ void MakeMapping::create() {
     vector<MappingRow> mapping_data;
     int row_count = 0;
     
-    // Fetch data in batches using the cursor
-    while (true) {
-        string fetch_sql = "FETCH " + to_string(NUM_ROWS_PER_COMMIT) + " FROM big_cursor";
-        result = PQexec(conn, fetch_sql.c_str());
+    vector<string> sortnames;
+    while (rows.next()) {
+        MappingRow mrow;
         
-        if (PQresultStatus(result) != PGRES_TUPLES_OK) {
-            log("FETCH failed: %s", PQerrorMessage(conn));
-            PQclear(result);
-            PQfinish(conn);
-            throw std::runtime_error("PostgreSQL FETCH failed");
-        }
+        // Check for NULL values and provide defaults
+        const char* val = rows.value(0);
+        mrow.artist_credit_id = (val && *val) ? strtoul(val, nullptr, 10) : 0;
         
-        int num_rows = PQntuples(result);
-        if (num_rows == 0) {
-            // No more rows
-            PQclear(result);
-            break;
+        // Handle PostgreSQL array - convert to comma-separated string
+        val = rows.value(1);
+        string mbids_raw = val ? val : "";
+        // Simple array parsing - remove { } and split by comma
+        if (mbids_raw.length() > 2 && mbids_raw[0] == '{' && mbids_raw.back() == '}') {
+            mbids_raw = mbids_raw.substr(1, mbids_raw.length() - 2);
         }
+        mrow.artist_mbids = mbids_raw;
         
-        for (int i = 0; i < num_rows; i++) {
-            MappingRow mrow;
-            
-            // Check for NULL values and provide defaults
-            char* val = PQgetvalue(result, i, 0);
-            mrow.artist_credit_id = (val && *val) ? strtoul(val, nullptr, 10) : 0;
-            
-            // Handle PostgreSQL array - convert to comma-separated string
-            val = PQgetvalue(result, i, 1);
-            string mbids_raw = val ? val : "";
-            // Simple array parsing - remove { } and split by comma
-            if (mbids_raw.length() > 2 && mbids_raw[0] == '{' && mbids_raw.back() == '}') {
-                mbids_raw = mbids_raw.substr(1, mbids_raw.length() - 2);
-            }
-            mrow.artist_mbids = mbids_raw;
-            
-            val = PQgetvalue(result, i, 2);
-            mrow.artist_credit_name = val ? val : "";
-            
-            // Handle sortname array - simple parsing
-            val = PQgetvalue(result, i, 3);
-            string sortname_raw = val ? val : "";
-            if (sortname_raw.length() > 2 && sortname_raw[0] == '{' && sortname_raw.back() == '}') {
-                sortname_raw = sortname_raw.substr(1, sortname_raw.length() - 2);
-                size_t comma_pos = sortname_raw.find(',');
-                if (comma_pos != string::npos) {
-                    sortname_raw = sortname_raw.substr(0, comma_pos);
-                }
-            }
-            mrow.artist_credit_sortname = sortname_raw;
-            
-            val = PQgetvalue(result, i, 4);
-            mrow.release_id = (val && *val) ? strtoul(val, nullptr, 10) : 0;
-            val = PQgetvalue(result, i, 5);
-            mrow.release_mbid = val ? val : "";
-            val = PQgetvalue(result, i, 6);
-            mrow.release_artist_credit_id = (val && *val) ? strtoul(val, nullptr, 10) : 0;
-            val = PQgetvalue(result, i, 7);
-            mrow.release_name = val ? val : "";
-            val = PQgetvalue(result, i, 8);
-            mrow.recording_id = (val && *val) ? strtoul(val, nullptr, 10) : 0;
-            val = PQgetvalue(result, i, 9);
-            mrow.recording_mbid = val ? val : "";
-            val = PQgetvalue(result, i, 10);
-            mrow.recording_name = val ? val : "";
-            val = PQgetvalue(result, i, 11);
-            mrow.score = (val && *val) ? strtoul(val, nullptr, 10) : 0;
-            
-            // Write directly to CSV instead of buffering
-            csvfile << mrow.artist_credit_id << ","
-                   << escape_csv_field(mrow.artist_mbids) << ","
-                   << escape_csv_field(mrow.artist_credit_name) << ","
-                   << escape_csv_field(mrow.artist_credit_sortname) << ","
-                   << mrow.release_id << ","
-                   << escape_csv_field(mrow.release_mbid) << ","
-                   << mrow.release_artist_credit_id << ","
-                   << escape_csv_field(mrow.release_name) << ","
-                   << mrow.recording_id << ","
-                   << escape_csv_field(mrow.recording_mbid) << ","
-                   << escape_csv_field(mrow.recording_name) << ","
-                   << mrow.score << endl;
-            
-            row_count++;
-        }
+        val = rows.value(2);
+        mrow.artist_credit_name = val ? val : "";
+        
+        // The sort name of the first artist
+        if (parse_pg_array(rows.value(3), sortnames))
+            mrow.artist_credit_sortname = sortnames[0];
         
-        PQclear(result);
+        val = rows.value(4);
+        mrow.release_id = (val && *val) ? strtoul(val, nullptr, 10) : 0;
+        val = rows.value(5);
+        mrow.release_mbid = val ? val : "";
+        val = rows.value(6);
+        mrow.release_artist_credit_id = (val && *val) ? strtoul(val, nullptr, 10) : 0;
+        val = rows.value(7);
+        mrow.release_name = val ? val : "";
+        val = rows.value(8);
+        mrow.recording_id = (val && *val) ? strtoul(val, nullptr, 10) : 0;
+        val = rows.value(9);
+        mrow.recording_mbid = val ? val : "";
+        val = rows.value(10);
+        mrow.recording_name = val ? val : "";
+        val = rows.value(11);
+        mrow.score = (val && *val) ? strtoul(val, nullptr, 10) : 0;
+        
+        // Write directly to CSV instead of buffering
+        csvfile << mrow.artist_credit_id << ","
+               << escape_csv_field(mrow.artist_mbids) << ","
+               << escape_csv_field(mrow.artist_credit_name) << ","
+               << escape_csv_field(mrow.artist_credit_sortname) << ","
+               << mrow.release_id << ","
+               << escape_csv_field(mrow.release_mbid) << ","
+               << mrow.release_artist_credit_id << ","
+               << escape_csv_field(mrow.release_name) << ","
+               << mrow.recording_id << ","
+               << escape_csv_field(mrow.recording_mbid) << ","
+               << escape_csv_field(mrow.recording_name) << ","
+               << mrow.score << '\n';
+        
+        row_count++;
     }
     
-    // Close cursor and end transaction
-    result = PQexec(conn, "CLOSE big_cursor");
-    PQclear(result);
-    result = PQexec(conn, "COMMIT");
-    PQclear(result);
-    
     csvfile.close();
-    PQfinish(conn);
     log("\nWrote %d rows to CSV", row_count);
     
     log("Importing CSV into SQLite...");
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <libpq-fe.h>
+#include "utils.hpp"
+using namespace std;
+
+// Connect to the database given by CANONICAL_MUSICBRAINZ_DATA_CONNECT, throwing if that fails
+inline PGconn *
+pg_connect() {
+    const char* db_connect = std::getenv("CANONICAL_MUSICBRAINZ_DATA_CONNECT");
+    if (!db_connect || strlen(db_connect) == 0)
+        throw std::runtime_error("CANONICAL_MUSICBRAINZ_DATA_CONNECT environment variable not set");
+
+    PGconn *conn = PQconnectdb(db_connect);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        log("Connection to database failed: %s", PQerrorMessage(conn));
+        PQfinish(conn);
+        throw std::runtime_error("PostgreSQL connection failed");
+    }
+    return conn;
+}
+
+// The rows of a query, one at a time as they come from the server. PQexec() holds the whole result in
+// memory before the first row can be looked at, in single row mode libpq only ever holds one row. The
+// stream has a connection of its own, which it closes when it goes, however the rows were left.
+class PGRowStream {
+    private:
+        PGconn                   *conn;
+        PGresult                 *row;
+        bool                      done;
+
+    public:
+        PGRowStream(const char *query) : row(nullptr), done(false) {
+            conn = pg_connect();
+            if (!PQsendQuery(conn, query) || !PQsetSingleRowMode(conn)) {
+                string error_msg = "Query failed: " + string(PQerrorMessage(conn));
+                PQfinish(conn);
+                throw std::runtime_error(error_msg);
+            }
+        }
+
+        PGRowStream(const PGRowStream &) = delete;
+        PGRowStream &operator=(const PGRowStream &) = delete;
+
+        ~PGRowStream() {
+            PQclear(row);
+            PQfinish(conn);
+        }
+
+        // Move on to the next row, false once there are no more. Throws if the query fails.
+        bool
+        next() {
+            PQclear(row);
+            row = nullptr;
+            if (done)
+                return false;
+
+            PGresult *res = PQgetResult(conn);
+            if (res && PQresultStatus(res) == PGRES_SINGLE_TUPLE) {
+                row = res;
+                return true;
+            }
+
+            // After the last row comes an empty result with the status of the query, then none at all
+            done = true;
+            bool ok = res && PQresultStatus(res) == PGRES_TUPLES_OK;
+            PQclear(res);
+            while ((res = PQgetResult(conn)) != nullptr)
+                PQclear(res);
+            if (!ok)
+                throw std::runtime_error("Query failed: " + string(PQerrorMessage(conn)));
+            return false;
+        }
+
+        const char *value(int column) const { return PQgetvalue(row, 0, column); }
+        int         length(int column) const { return PQgetlength(row, 0, column); }
+        bool        is_null(int column) const { return PQgetisnull(row, 0, column); }
+};
+
+// Split a PostgreSQL array such as {a,"b c","d\"e"} into its elements. The strings already in elements are
+// reused, so that parsing an array for every row of a query doesn't allocate for every row. Returns the
+// number of elements, which elements is resized to.
+inline size_t
+parse_pg_array(const char *array_str, vector<string> &elements) {
+    size_t count = 0;
+    if (!array_str || array_str[0] != '{') {
+        elements.clear();
+        return 0;
+    }
+
+    const char *p = array_str + 1;
+    while (*p && *p != '}') {
+        if (count == elements.size())
+            elements.emplace_back();
+        string &element = elements[count++];
+
+        if (*p == '"') {
+            // Copied in one go up to the first backslash, if there is one
+            const char *start = ++p;
+            while (*p && *p != '"' && *p != '\\')
+                p++;
+            element.assign(start, p - start);
+            while (*p && *p != '"') {
+                if (*p == '\\' && p[1])
+                    p++;
+                element.push_back(*p++);
+            }
+            if (*p == '"')
+                p++;
+        }
+        else {
+            const char *start = p;
+            while (*p && *p != ',' && *p != '}')
+                p++;
+            element.assign(start, p - start);
+        }
+        if (*p == ',')
+            p++;
+    }
+    elements.resize(count);
+    return count;
+}
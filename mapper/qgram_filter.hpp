@@ -0,0 +1,248 @@
+#pragma once
+
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+#include "index_file.hpp"
+
+// Index file sections that QGramFilter::sections() gives
+const unsigned int QGRAM_FILTER_SECTIONS = 5;
+
+// Scratch memory for QGramFilter::candidates(), kept from one query to the next
+struct QGramScratch {
+    vector<uint16_t>              query_grams;
+    vector<uint32_t>              counts;
+};
+
+// Finds the texts that can be within k edits of a query without computing a single distance, by the q-gram
+// lemma: one edit destroys at most q of the q-grams of a string, so if ed(s, t) <= k then s and t have at
+// least max(|s|, |t|) - q + 1 - k * q q-grams in common, counted with multiplicity. The texts are bucketed by
+// length, so only those whose length is within k of the query's are looked at.
+//
+// Bigrams are indexed. Where k is too large for the bigram bound to rule anything out, the texts are
+// checked against the bound for single characters, max(|s|, |t|) - k, instead.
+//
+// Texts are strings of bytes, or spans of code points. Bigrams and characters beyond a byte are hashed, and
+// since characters that share a hash can only add to the counts, the filter still lets every match through.
+class QGramFilter {
+    private:
+        static const unsigned int Q = 2;
+
+        // Texts are numbered by length: the texts of length l have ranks [length_offsets[l], length_offsets[l + 1])
+        // and rank r is document rank_docs[r]
+        FlatArray<uint32_t>       length_offsets;
+        FlatArray<uint32_t>       rank_docs;
+
+        // Bigram grams[g] occurs in the texts gram_ranks[gram_offsets[g], gram_offsets[g + 1]), in ascending
+        // order of rank and once per occurrence
+        FlatArray<uint16_t>       grams;
+        FlatArray<uint32_t>       gram_offsets;
+        FlatArray<uint32_t>       gram_ranks;
+
+        static uint32_t unit(char c) { return (uint8_t)c; }
+        static uint32_t unit(uint32_t c) { return c; }
+
+        // Exact for two bytes
+        template <typename Text>
+        static uint16_t
+        gram(const Text &text, size_t i) {
+            uint32_t a = unit(text[i]), b = unit(text[i + 1]);
+            return (uint16_t)((a << 8 | b) ^ (a >> 8) * 0x9e37 ^ (b >> 8) * 0x7f4b);
+        }
+
+        // Common bigrams that a text of length m within k edits of a query of length n must have
+        static long
+        bigram_bound(size_t n, size_t m, size_t k) {
+            return (long)max(n, m) - (long)(Q - 1) - (long)(k * Q);
+        }
+
+    public:
+
+        // Index the texts of documents [0, num_docs), where text(doc) returns the text of doc
+        template <typename Text>
+        void
+        build(size_t num_docs, Text text) {
+            size_t max_length = 0;
+            for(size_t doc = 0; doc < num_docs; doc++)
+                max_length = max(max_length, text(doc).size());
+
+            vector<uint32_t> lengths(max_length + 2, 0);
+            for(size_t doc = 0; doc < num_docs; doc++)
+                lengths[text(doc).size() + 1]++;
+            for(size_t l = 1; l < lengths.size(); l++)
+                lengths[l] += lengths[l - 1];
+            vector<uint32_t> next(lengths.begin(), lengths.end() - 1);
+            vector<uint32_t> docs(num_docs);
+            for(size_t doc = 0; doc < num_docs; doc++)
+                docs[next[text(doc).size()]++] = doc;
+
+            // Counting sort by bigram, walking the texts by rank so that every posting list comes out sorted
+            vector<uint32_t> starts(UINT16_MAX + 2, 0);
+            for(uint32_t rank = 0; rank < num_docs; rank++) {
+                auto t = text(docs[rank]);
+                for(size_t i = 0; i + 1 < t.size(); i++)
+                    starts[gram(t, i) + 1]++;
+            }
+            for(size_t g = 1; g < starts.size(); g++)
+                starts[g] += starts[g - 1];
+            vector<uint32_t> ranks(starts.back());
+            next.assign(starts.begin(), starts.end() - 1);
+            for(uint32_t rank = 0; rank < num_docs; rank++) {
+                auto t = text(docs[rank]);
+                for(size_t i = 0; i + 1 < t.size(); i++)
+                    ranks[next[gram(t, i)]++] = rank;
+            }
+
+            vector<uint16_t> present;
+            vector<uint32_t> offsets(1, 0);
+            for(size_t g = 0; g + 1 < starts.size(); g++)
+                if (starts[g + 1] > starts[g]) {
+                    present.push_back(g);
+                    offsets.push_back(starts[g + 1]);
+                }
+
+            length_offsets.assign(std::move(lengths));
+            rank_docs.assign(std::move(docs));
+            grams.assign(std::move(present));
+            gram_offsets.assign(std::move(offsets));
+            gram_ranks.assign(std::move(ranks));
+        }
+
+        // Whether the arrays of a filter over num_docs texts fit together, so that candidates() can't read past
+        // any of them. Filters loaded from a file are checked before they are used.
+        bool
+        consistent(size_t num_docs) const {
+            bool ok = length_offsets.size() >= 2 && length_offsets[0] == 0 && length_offsets.back() == num_docs &&
+                      rank_docs.size() == num_docs && gram_offsets.size() == grams.size() + 1 &&
+                      gram_offsets[0] == 0 && gram_offsets.back() == gram_ranks.size();
+            for(size_t l = 1; ok && l < length_offsets.size(); l++)
+                ok = length_offsets[l - 1] <= length_offsets[l];
+            for(size_t g = 1; ok && g < gram_offsets.size(); g++)
+                ok = gram_offsets[g - 1] <= gram_offsets[g];
+            for(size_t r = 0; ok && r < rank_docs.size(); r++)
+                ok = rank_docs[r] < num_docs;
+            // candidates() relies on the ranks of each bigram being in order
+            for(size_t g = 0; ok && g < grams.size(); g++)
+                for(size_t i = gram_offsets[g]; ok && i < gram_offsets[g + 1]; i++)
+                    ok = gram_ranks[i] < num_docs && (i == gram_offsets[g] || gram_ranks[i - 1] <= gram_ranks[i]);
+            return ok;
+        }
+
+        // The arrays of the filter, to be written to an index file as QGRAM_FILTER_SECTIONS sections
+        void
+        sections(vector<IndexFileData> &data) const {
+            data.push_back({ length_offsets.data(), length_offsets.size() * sizeof(uint32_t) });
+            data.push_back({ rank_docs.data(), rank_docs.size() * sizeof(uint32_t) });
+            data.push_back({ grams.data(), grams.size() * sizeof(uint16_t) });
+            data.push_back({ gram_offsets.data(), gram_offsets.size() * sizeof(uint32_t) });
+            data.push_back({ gram_ranks.data(), gram_ranks.size() * sizeof(uint32_t) });
+        }
+
+        // Use the filter that sections() wrote to file from section first on, without copying it
+        bool
+        view(const MappedIndexFile &file, uint32_t first) {
+            return file.view_section(first, length_offsets) && file.view_section(first + 1, rank_docs) &&
+                   file.view_section(first + 2, grams) && file.view_section(first + 3, gram_offsets) &&
+                   file.view_section(first + 4, gram_ranks);
+        }
+
+        void
+        clear() {
+            length_offsets.assign(vector<uint32_t>());
+            rank_docs.assign(vector<uint32_t>());
+            grams.assign(vector<uint16_t>());
+            gram_offsets.assign(vector<uint32_t>());
+            gram_ranks.assign(vector<uint32_t>());
+        }
+
+        void
+        swap(QGramFilter &other) {
+            length_offsets.swap(other.length_offsets);
+            rank_docs.swap(other.rank_docs);
+            grams.swap(other.grams);
+            gram_offsets.swap(other.gram_offsets);
+            gram_ranks.swap(other.gram_ranks);
+        }
+
+        template<class Archive>
+        void serialize(Archive & archive)
+        {
+            archive(length_offsets, rank_docs, grams, gram_offsets, gram_ranks);
+        }
+
+        // Replace docs with the documents whose text may be within max_distance edits of query, in no
+        // particular order. Every document that is within the distance is among them. query must be of
+        // the same kind as the texts.
+        template <typename Query, typename Text>
+        void
+        candidates(const Query &query, size_t max_distance, Text text, QGramScratch &scratch,
+                   vector<unsigned int> &docs) const {
+            docs.clear();
+            if (rank_docs.size() == 0)
+                return;
+            size_t n = query.size(), k = min(max_distance, n + length_offsets.size());
+            if (n > k + length_offsets.size() - 2)
+                return;
+            size_t min_length = n > k ? n - k : 0;
+            size_t max_length = min(n + k, length_offsets.size() - 2);
+
+            // Up to a length, the bigram bound is no bound at all
+            size_t bigram_length = min_length;
+            while (bigram_length <= max_length && bigram_bound(n, bigram_length, k) <= 0)
+                bigram_length++;
+
+            if (bigram_length > min_length) {
+                int available[256] = { 0 };
+                for(auto ch : query)
+                    available[unit(ch) & 0xff]++;
+                for(uint32_t rank = length_offsets[min_length]; rank < length_offsets[bigram_length]; rank++) {
+                    auto t = text(rank_docs[rank]);
+                    long common = 0;
+                    for(auto ch : t)
+                        common += available[unit(ch) & 0xff]-- > 0;
+                    for(auto ch : t)
+                        available[unit(ch) & 0xff]++;
+                    if (common >= (long)max(n, t.size()) - (long)k)
+                        docs.push_back(rank_docs[rank]);
+                }
+            }
+            if (bigram_length > max_length)
+                return;
+
+            uint32_t lo = length_offsets[bigram_length], hi = length_offsets[max_length + 1];
+            scratch.counts.assign(hi - lo, 0);
+            scratch.query_grams.clear();
+            for(size_t i = 0; i + 1 < n; i++)
+                scratch.query_grams.push_back(gram(query, i));
+            sort(scratch.query_grams.begin(), scratch.query_grams.end());
+
+            // A bigram that occurs c times in the query counts at most c times for a text
+            for(size_t i = 0, j; i < scratch.query_grams.size(); i = j) {
+                for(j = i + 1; j < scratch.query_grams.size() && scratch.query_grams[j] == scratch.query_grams[i]; j++)
+                    ;
+                auto it = lower_bound(grams.begin(), grams.end(), scratch.query_grams[i]);
+                if (it == grams.end() || *it != scratch.query_grams[i])
+                    continue;
+
+                const uint32_t *end = gram_ranks.data() + gram_offsets[it - grams.begin() + 1];
+                const uint32_t *p = lower_bound(gram_ranks.data() + gram_offsets[it - grams.begin()], end, lo);
+                uint32_t previous = UINT32_MAX, occurrences = 0;
+                for(; p < end && *p < hi; p++) {
+                    occurrences = *p == previous ? occurrences + 1 : 1;
+                    previous = *p;
+                    if (occurrences <= j - i)
+                        scratch.counts[*p - lo]++;
+                }
+            }
+
+            for(size_t l = bigram_length; l <= max_length; l++) {
+                long bound = bigram_bound(n, l, k);
+                for(uint32_t rank = length_offsets[l]; rank < length_offsets[l + 1]; rank++)
+                    if ((long)scratch.counts[rank - lo] >= bound)
+                        docs.push_back(rank_docs[rank]);
+            }
+        }
+};
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <ctime>
 #include <algorithm>
+#include <mutex>
 #include "SQLiteCpp.h"
 #include "fuzzy_index.hpp"
 #include "encode.hpp"
@@ -37,6 +38,15 @@ const char *fetch_query = R"(
     ORDER BY score, m.release_id
 )";
 
+const char *fetch_vocabulary_texts_query = R"(
+      SELECT recording_name
+           , release_name
+        FROM mapping
+)";
+
+const char *fetch_vocabulary_header_query =
+    "SELECT substr(index_data, 1, 12) FROM index_cache WHERE entity_id = ?";
+
 const char *fetch_recording_aliases_query = R"(
       SELECT r.id
            , ra.name
@@ -51,6 +61,13 @@ class RecordingIndex {
         EncodeSearchData               encode;
         map<unsigned int, set<string>> recording_aliases;
 
+        // The vocabulary that new indexes are built with, null to fit one for each index
+        shared_ptr<const TfIdfVectorizer> vocabulary;
+
+        // The global vocabulary, shared by all the indexes of this process until it is fitted again
+        static inline mutex                             global_vocabulary_mutex;
+        static inline shared_ptr<const TfIdfVectorizer> global_vocabulary;
+
     public:
 
         RecordingIndex(const string &index_dir_) {
@@ -66,40 +83,16 @@ class RecordingIndex {
             log("load recording aliases");
             try
             {
-                PGconn     *conn;
-                PGresult   *res;
-                
-                const char* db_connect = std::getenv("CANONICAL_MUSICBRAINZ_DATA_CONNECT");
-                if (!db_connect || strlen(db_connect) == 0) {
-                    throw std::runtime_error("CANONICAL_MUSICBRAINZ_DATA_CONNECT environment variable not set");
-                }
-                conn = PQconnectdb(db_connect);
-                if (PQstatus(conn) != CONNECTION_OK) {
-                    log("Connection to database failed: %s", PQerrorMessage(conn));
-                    PQfinish(conn);
-                    throw std::runtime_error("PostgreSQL connection failed");
-                }
-               
-                res = PQexec(conn, fetch_recording_aliases_query);
-                if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-                    std::string error_msg = "Query failed: " + std::string(PQerrorMessage(conn));
-                    PQclear(res);
-                    PQfinish(conn);
-                    throw std::runtime_error(error_msg);
-                }
-
-                for (int i = 0; i < PQntuples(res); i++) {
-                    unsigned int recording_id = atoi(PQgetvalue(res, i, 0));
+                PGRowStream rows(fetch_recording_aliases_query);
+                string encoded;
+                while (rows.next()) {
+                    unsigned int recording_id = atoi(rows.value(0));
                     
                     // TODO: add this to stupid recording index
-                    string encoded = encode.encode_string(PQgetvalue(res, i, 1));
+                    encode.encode_string(string_view(rows.value(1), rows.length(1)), encoded);
                     if (encoded.size())
                         recording_aliases[recording_id].insert(encoded);
                 }
-                
-                // Clear the PGresult object to free memory
-                PQclear(res);
-                PQfinish(conn);
             }
             catch (exception& e)
             {
@@ -107,6 +100,128 @@ class RecordingIndex {
             }
         }
 
+        // The global vocabulary from the index cache, or null if there is none. It is only loaded again
+        // when the fingerprint at the start of its blob shows that it was fitted again.
+        static shared_ptr<const TfIdfVectorizer>
+        load_global_vocabulary(SQLite::Database &db) {
+            lock_guard<mutex> lock(global_vocabulary_mutex);
+            try
+            {
+                uint32_t magic = 0;
+                uint64_t fingerprint = 0;
+                SQLite::Statement     header(db, fetch_vocabulary_header_query);
+                header.bind(1, GLOBAL_VOCABULARY_ENTITY_ID);
+                if (!header.executeStep() || header.getColumn(0).getBytes() != sizeof(magic) + sizeof(fingerprint)) {
+                    global_vocabulary.reset();
+                    return nullptr;
+                }
+                const char *header_data = static_cast<const char*>(header.getColumn(0).getBlob());
+                memcpy(&magic, header_data, sizeof(magic));
+                memcpy(&fingerprint, header_data + sizeof(magic), sizeof(fingerprint));
+                if (magic != GLOBAL_VOCABULARY_BLOB_MAGIC) {
+                    log("global vocabulary has an old format, it needs to be fitted again");
+                    global_vocabulary.reset();
+                    return nullptr;
+                }
+                if (global_vocabulary && global_vocabulary->fingerprint() == fingerprint)
+                    return global_vocabulary;
+
+                SQLite::Statement     query(db, fetch_blob_query);
+            
+                query.bind(1, GLOBAL_VOCABULARY_ENTITY_ID);
+                global_vocabulary.reset();
+                if (query.executeStep()) {
+                    const void* blob_data = query.getColumn(0).getBlob();
+                    size_t blob_size = query.getColumn(0).getBytes();
+                    
+                    std::stringstream ss;
+                    ss.write(static_cast<const char*>(blob_data), blob_size);
+                    ss.seekg(ios_base::beg);
+                    auto loaded = make_shared<TfIdfVectorizer>(false, false);
+                    {
+                        cereal::BinaryInputArchive iarchive(ss);
+                        iarchive(magic, fingerprint, *loaded);
+                    }
+                    if (loaded->fingerprint() != fingerprint)
+                        log("global vocabulary doesn't match its fingerprint, it needs to be fitted again");
+                    else
+                        global_vocabulary = loaded;
+                }
+            }
+            catch (std::exception& e)
+            {
+                log("load global vocabulary db exception: %s", e.what());
+            }
+            return global_vocabulary;
+        }
+
+        // Build the recording and release indexes with one vocabulary and idf, fitted to all recording, alias
+        // and release names, instead of fitting one to the names of each artist. The index blobs then only
+        // hold their postings. The vocabulary is stored in the index cache the first time and reused after
+        // that, since the indexes built with it depend on it; they store its fingerprint, and aren't loaded
+        // with any other. Returns false if there is no vocabulary.
+        bool
+        use_global_vocabulary(SQLite::Database &db, unsigned int num_threads) {
+            vocabulary = load_global_vocabulary(db);
+            if (vocabulary)
+                return true;
+
+            // Documents are distinct names, cut to the length that the indexes vectorise
+            vector<string> texts;
+            try
+            {
+                SQLite::Statement   query(db, fetch_vocabulary_texts_query);
+                while (query.executeStep())
+                    for(int col = 0; col < 2; col++) {
+                        string name = query.getColumn(col);
+                        string encoded = encode.encode_string(name);
+                        if (encoded.size())
+                            texts.push_back(encoded.substr(0, MAX_ENCODED_STRING_LENGTH));
+                    }
+            }
+            catch (std::exception& e)
+            {
+                log("global vocabulary db exception: %s", e.what());
+                return false;
+            }
+            for(auto &it : recording_aliases)
+                for(auto &alias : it.second)
+                    texts.push_back(alias.substr(0, MAX_ENCODED_STRING_LENGTH));
+            sort(texts.begin(), texts.end());
+            texts.erase(unique(texts.begin(), texts.end()), texts.end());
+            if (texts.size() == 0)
+                return false;
+
+            log("fit global vocabulary to %zu names", texts.size());
+            auto fitted = make_shared<TfIdfVectorizer>(false, false);
+            fitted->fit(texts, num_threads);
+            vector<string>().swap(texts);
+
+            try
+            {
+                std::stringstream ss;
+                {
+                    cereal::BinaryOutputArchive oarchive(ss);
+                    oarchive(GLOBAL_VOCABULARY_BLOB_MAGIC, fitted->fingerprint(), *fitted);
+                }
+                string blob = ss.str();
+                SQLite::Statement query(db, insert_blob_query);
+                query.bind(1, GLOBAL_VOCABULARY_ENTITY_ID);
+                query.bind(2, blob.data(), (int32_t)blob.size());
+                query.exec();
+            }
+            catch (std::exception& e)
+            {
+                log("save global vocabulary db exception: %s", e.what());
+                return false;
+            }
+
+            lock_guard<mutex> lock(global_vocabulary_mutex);
+            global_vocabulary = fitted;
+            vocabulary = fitted;
+            return true;
+        }
+
         ReleaseRecordingIndex
         build_recording_release_indexes(unsigned int artist_credit_id) {
 
@@ -219,7 +334,8 @@ class RecordingIndex {
             FuzzyIndex *recording_index = new FuzzyIndex();
             try
             {
-                recording_index->build(recording_ids, recording_texts);
+                recording_index->build(recording_ids, recording_texts, vocabulary);
+                recording_index->quantise_weights(WEIGHT_FORMAT_PACKED);
             }
             catch(const std::exception& e)
             {
@@ -236,7 +352,8 @@ class RecordingIndex {
             FuzzyIndex *release_index = new FuzzyIndex();
             try
             {
-                release_index->build(release_ids, release_texts);
+                release_index->build(release_ids, release_texts, vocabulary);
+                release_index->quantise_weights(WEIGHT_FORMAT_PACKED);
             }
             catch(const std::exception& e)
             {
@@ -277,6 +394,13 @@ class RecordingIndex {
                         cereal::BinaryInputArchive iarchive(ss);
                         iarchive(*recording_index, *release_index, links);
                     }
+                    if (recording_index->needs_vocabulary() || release_index->needs_vocabulary()) {
+                        auto shared = load_global_vocabulary(db);
+                        if (!shared)
+                            throw std::runtime_error("index needs the global vocabulary, which is missing");
+                        if (!recording_index->use_vocabulary(shared) || !release_index->use_vocabulary(shared))
+                            throw std::runtime_error("index doesn't fit the global vocabulary");
+                    }
                     return new ReleaseRecordingIndex(recording_index, release_index, links);
                 } else {
                     log("Cannot load index for %d", artist_credit_id);
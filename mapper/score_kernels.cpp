@@ -0,0 +1,222 @@
+#include <math.h>
+#include <string.h>
+#include "score_kernels.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+static size_t
+accumulate_postings_scalar(float *accumulator, const unsigned int *ids, const float *weights,
+                           size_t n, float weight, unsigned int *new_docs) {
+    size_t num_new = 0;
+    for(size_t i = 0; i < n; i++) {
+        unsigned int doc = ids[i];
+        if (accumulator[doc] == 0.0f)
+            new_docs[num_new++] = doc;
+        accumulator[doc] = fmaf(weight, weights[i], accumulator[doc]);
+    }
+    return num_new;
+}
+
+static size_t
+collect_scores_scalar(float *accumulator, const unsigned int *docs, size_t n,
+                      float bound, float threshold, ScoredDoc *hits) {
+    size_t num_hits = 0;
+    for(size_t i = 0; i < n; i++) {
+        unsigned int doc = docs[i];
+        float score = accumulator[doc];
+        accumulator[doc] = 0.0f;
+        if (score + bound >= threshold)
+            hits[num_hits++] = { score, doc };
+    }
+    return num_hits;
+}
+
+static inline unsigned int
+read_gap(const uint8_t *data, unsigned int bits, size_t i) {
+    size_t bit = i * bits;
+    uint64_t word;
+    memcpy(&word, data + bit / 8, sizeof(word));
+    return (unsigned int)((word >> (bit % 8)) & ((1ull << bits) - 1));
+}
+
+static void
+unpack_doc_ids_scalar(const uint8_t *data, unsigned int bits, size_t n, unsigned int first_doc,
+                      unsigned int *docs) {
+    if (n == 0)
+        return;
+    docs[0] = first_doc;
+    for(size_t i = 1; i < n; i++)
+        docs[i] = docs[i - 1] + 1 + read_gap(data, bits, i - 1);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Gathers 32 bit words from the byte offsets of eight gaps and shifts each gap into place, then turns
+// the gaps into ids with a prefix sum. Wider gaps don't fit a 32 bit word and take the scalar path.
+__attribute__((target("avx2")))
+static void
+unpack_doc_ids_avx2(const uint8_t *data, unsigned int bits, size_t n, unsigned int first_doc,
+                    unsigned int *docs) {
+    if (n == 0 || bits > 25) {
+        unpack_doc_ids_scalar(data, bits, n, first_doc, docs);
+        return;
+    }
+
+    size_t num_gaps = n - 1, i = 0;
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i width = _mm256_set1_epi32(bits);
+    __m256i mask = _mm256_set1_epi32((1u << bits) - 1);
+    __m256i seven = _mm256_set1_epi32(7);
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i last = _mm256_set1_epi32(first_doc);
+
+    docs[0] = first_doc;
+    for(; i + 8 <= num_gaps; i += 8) {
+        __m256i bit = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_set1_epi32(i), lanes), width);
+        __m256i word = _mm256_i32gather_epi32((const int *)data, _mm256_srli_epi32(bit, 3), 1);
+        __m256i step = _mm256_add_epi32(_mm256_and_si256(_mm256_srlv_epi32(word, _mm256_and_si256(bit, seven)), mask), one);
+
+        // Prefix sum within each 128 bit half, then carry the low half into the high half
+        step = _mm256_add_epi32(step, _mm256_slli_si256(step, 4));
+        step = _mm256_add_epi32(step, _mm256_slli_si256(step, 8));
+        __m256i low_total = _mm256_shuffle_epi32(step, 0xff);
+        step = _mm256_add_epi32(step, _mm256_permute2x128_si256(low_total, low_total, 0x08));
+
+        step = _mm256_add_epi32(step, last);
+        _mm256_storeu_si256((__m256i *)(docs + 1 + i), step);
+        last = _mm256_permutevar8x32_epi32(step, seven);
+    }
+    for(; i < num_gaps; i++)
+        docs[i + 1] = docs[i] + 1 + read_gap(data, bits, i);
+}
+
+// AVX2 has gathers but no scatters, so the updated scores are written back one lane at a time
+__attribute__((target("avx2,fma")))
+static size_t
+accumulate_postings_avx2(float *accumulator, const unsigned int *ids, const float *weights,
+                         size_t n, float weight, unsigned int *new_docs) {
+    size_t num_new = 0, i = 0;
+    __m256 w = _mm256_set1_ps(weight);
+    alignas(32) float updated[8];
+    alignas(32) unsigned int lanes[8];
+
+    for(; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_loadu_si256((const __m256i *)(ids + i));
+        __m256 acc = _mm256_i32gather_ps(accumulator, idx, 4);
+        unsigned int fresh = _mm256_movemask_ps(_mm256_cmp_ps(acc, _mm256_setzero_ps(), _CMP_EQ_OQ));
+        acc = _mm256_fmadd_ps(w, _mm256_loadu_ps(weights + i), acc);
+        _mm256_store_ps(updated, acc);
+        _mm256_store_si256((__m256i *)lanes, idx);
+        for(int j = 0; j < 8; j++)
+            accumulator[lanes[j]] = updated[j];
+        for(; fresh; fresh &= fresh - 1)
+            new_docs[num_new++] = lanes[__builtin_ctz(fresh)];
+    }
+    return num_new + accumulate_postings_scalar(accumulator, ids + i, weights + i, n - i, weight, new_docs + num_new);
+}
+
+__attribute__((target("avx2,fma")))
+static size_t
+collect_scores_avx2(float *accumulator, const unsigned int *docs, size_t n,
+                    float bound, float threshold, ScoredDoc *hits) {
+    size_t num_hits = 0, i = 0;
+    __m256 b = _mm256_set1_ps(bound);
+    __m256 t = _mm256_set1_ps(threshold);
+    alignas(32) float scores[8];
+
+    for(; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_loadu_si256((const __m256i *)(docs + i));
+        __m256 score = _mm256_i32gather_ps(accumulator, idx, 4);
+        unsigned int keep = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_add_ps(score, b), t, _CMP_GE_OQ));
+        _mm256_store_ps(scores, score);
+        for(int j = 0; j < 8; j++)
+            accumulator[docs[i + j]] = 0.0f;
+        for(; keep; keep &= keep - 1) {
+            int j = __builtin_ctz(keep);
+            hits[num_hits++] = { scores[j], docs[i + j] };
+        }
+    }
+    return num_hits + collect_scores_scalar(accumulator, docs + i, n - i, bound, threshold, hits + num_hits);
+}
+
+__attribute__((target("avx512f")))
+static size_t
+accumulate_postings_avx512(float *accumulator, const unsigned int *ids, const float *weights,
+                           size_t n, float weight, unsigned int *new_docs) {
+    size_t num_new = 0, i = 0;
+    __m512 w = _mm512_set1_ps(weight);
+
+    for(; i + 16 <= n; i += 16) {
+        __m512i idx = _mm512_loadu_si512(ids + i);
+        __m512 acc = _mm512_i32gather_ps(idx, accumulator, 4);
+        __mmask16 fresh = _mm512_cmp_ps_mask(acc, _mm512_setzero_ps(), _CMP_EQ_OQ);
+        _mm512_mask_compressstoreu_epi32(new_docs + num_new, fresh, idx);
+        num_new += __builtin_popcount(fresh);
+        acc = _mm512_fmadd_ps(w, _mm512_loadu_ps(weights + i), acc);
+        _mm512_i32scatter_ps(accumulator, idx, acc, 4);
+    }
+    return num_new + accumulate_postings_scalar(accumulator, ids + i, weights + i, n - i, weight, new_docs + num_new);
+}
+
+__attribute__((target("avx512f")))
+static size_t
+collect_scores_avx512(float *accumulator, const unsigned int *docs, size_t n,
+                      float bound, float threshold, ScoredDoc *hits) {
+    size_t num_hits = 0, i = 0;
+    __m512 b = _mm512_set1_ps(bound);
+    __m512 t = _mm512_set1_ps(threshold);
+    alignas(64) float scores[16];
+    alignas(64) unsigned int kept[16];
+
+    for(; i + 16 <= n; i += 16) {
+        __m512i idx = _mm512_loadu_si512(docs + i);
+        __m512 score = _mm512_i32gather_ps(idx, accumulator, 4);
+        _mm512_i32scatter_ps(accumulator, idx, _mm512_setzero_ps(), 4);
+        __mmask16 keep = _mm512_cmp_ps_mask(_mm512_add_ps(score, b), t, _CMP_GE_OQ);
+        _mm512_mask_compressstoreu_ps(scores, keep, score);
+        _mm512_mask_compressstoreu_epi32(kept, keep, idx);
+        int count = __builtin_popcount(keep);
+        for(int j = 0; j < count; j++)
+            hits[num_hits++] = { scores[j], kept[j] };
+    }
+    return num_hits + collect_scores_scalar(accumulator, docs + i, n - i, bound, threshold, hits + num_hits);
+}
+
+#endif
+
+static const ScoreKernels kernel_table[NUM_SCORE_KERNEL_LEVELS] = {
+    { "scalar", accumulate_postings_scalar, collect_scores_scalar, unpack_doc_ids_scalar },
+#ifdef HAVE_X86_KERNELS
+    { "avx2", accumulate_postings_avx2, collect_scores_avx2, unpack_doc_ids_avx2 },
+    // AVX-512 has no faster way to unpack than the AVX2 gathers, which every AVX-512 CPU supports
+    { "avx512", accumulate_postings_avx512, collect_scores_avx512, unpack_doc_ids_avx2 },
+#endif
+};
+
+const ScoreKernels *
+get_score_kernels(int level) {
+    if (level < 0 || level >= NUM_SCORE_KERNEL_LEVELS || kernel_table[level].name == nullptr)
+        return nullptr;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (level == SCORE_KERNELS_AVX2 && !(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")))
+        return nullptr;
+    if (level == SCORE_KERNELS_AVX512 && !(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2")))
+        return nullptr;
+#endif
+    return &kernel_table[level];
+}
+
+const ScoreKernels &
+score_kernels() {
+    static const ScoreKernels *kernels = []() {
+        for(int level = NUM_SCORE_KERNEL_LEVELS - 1; level > 0; level--)
+            if (get_score_kernels(level))
+                return get_score_kernels(level);
+        return get_score_kernels(SCORE_KERNELS_SCALAR);
+    }();
+    return *kernels;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ScoredDoc {
+    float          score;
+    unsigned int   doc;
+};
+
+// Instruction set levels of the score kernels
+enum ScoreKernelLevel {
+    SCORE_KERNELS_SCALAR = 0,
+    SCORE_KERNELS_AVX2,
+    SCORE_KERNELS_AVX512,
+    NUM_SCORE_KERNEL_LEVELS
+};
+
+// The inner loops of FuzzyIndex scoring. Scores are accumulated with fused multiply-adds, so every
+// level computes exactly the same results as the scalar reference.
+struct ScoreKernels {
+    const char    *name;
+
+    // Add weight * weights[i] to accumulator[ids[i]] for one posting list, whose ids must be distinct
+    // and below 2^31. Documents whose accumulator was zero before are appended to new_docs, which must
+    // have room for n entries. Returns the number of new documents.
+    size_t       (*accumulate_postings)(float *accumulator, const unsigned int *ids, const float *weights,
+                                        size_t n, float weight, unsigned int *new_docs);
+
+    // Move the scores of docs out of accumulator, leaving it zeroed, and append those with
+    // score + bound >= threshold to hits, which must have room for n entries. Returns the number of hits.
+    size_t       (*collect_scores)(float *accumulator, const unsigned int *docs, size_t n,
+                                   float bound, float threshold, ScoredDoc *hits);
+
+    // Decode the n ascending doc ids of a compressed posting block into docs. docs[0] is first_doc and
+    // every following id is one more than the previous plus a gap of the given bit width (at most 32),
+    // the gaps being packed least significant bit first. data must stay readable for 8 bytes past the gaps.
+    void         (*unpack_doc_ids)(const uint8_t *data, unsigned int bits, size_t n, unsigned int first_doc,
+                                   unsigned int *docs);
+};
+
+// The kernels of the given level, or nullptr if this CPU or build can't run them
+const ScoreKernels *get_score_kernels(int level);
+
+// The fastest kernels this CPU supports, picked on first use
+const ScoreKernels &score_kernels();
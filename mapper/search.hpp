@@ -40,6 +40,7 @@ class SearchFunctions {
         string                              db_file;
         IndexCache                         *index_cache;  // Shared, not owned
         EncodeSearchData                    encode;
+        EncodeCache                         encode_cache;
         std::unique_ptr<SQLite::Database>   db;
 
         // Lazy initialization of DB connection
@@ -53,7 +54,7 @@ class SearchFunctions {
     public:
 
         // index_cache is shared across threads - caller retains ownership
-        SearchFunctions(const string &_index_dir, IndexCache *_index_cache) {
+        SearchFunctions(const string &_index_dir, IndexCache *_index_cache) : encode_cache(encode) {
             index_dir = _index_dir;
             db_file = index_dir + string("/mapping.db");
             index_cache = _index_cache;
@@ -63,6 +64,13 @@ class SearchFunctions {
             // index_cache is shared, don't delete it
         }
 
+        // The encoded form of a search string. Searches repeat the same strings a lot, so they are cached.
+        // The returned entry stays valid until the next call.
+        const EncodedString &
+        encode_query(const string &text) {
+            return encode_cache.lookup(text);
+        }
+
         vector<string> split(const std::string& input) {
             vector<std::string> result;
             stringstream        ss(input);
@@ -134,8 +142,10 @@ class SearchFunctions {
             return "";
         }
 
-        vector<IndexResult> *
-        get_canonical_release_id(unsigned int artist_credit_id, unsigned int recording_id) {
+        // Replace results with the canonical release of the recording. Returns false if there is none.
+        bool
+        get_canonical_release_id(unsigned int artist_credit_id, unsigned int recording_id, vector<IndexResult> &results) {
+            results.clear();
             try {
                 string sql = "SELECT release_id FROM mapping WHERE artist_credit_id = ? AND recording_id = ? ORDER BY score LIMIT 1";
                 SQLite::Statement query(get_db(), sql);
@@ -144,17 +154,16 @@ class SearchFunctions {
                 query.bind(2, recording_id);
 
                 if (query.executeStep()) {
-                    auto results = new vector<IndexResult>();
                     unsigned int release_id = query.getColumn(0).getUInt();
                     float score = 1.0;
-                    results->push_back(IndexResult(release_id, 0, score, 'r'));
-                    return results;
+                    results.push_back(IndexResult(release_id, 0, score, 'r'));
+                    return true;
                 } 
             }
             catch (std::exception& e) {
                 printf("get_canonical_release_id db exception: %s\n", e.what());
             }
-            return nullptr;
+            return false;
         }
 
         ReleaseRecordingIndex *
@@ -172,63 +181,75 @@ class SearchFunctions {
             return release_recording_index;
         }
 
-        vector<IndexResult> *
+        // Replace results with the matches for release_name, reusing the scratch memory in ctx
+        void
         release_search(ReleaseRecordingIndex *release_recording_index, 
-                       const string          &release_name) {
+                       const string          &release_name,
+                       vector<IndexResult>   &results,
+                       FuzzySearchContext    &ctx) {
 
             // Improve thresholding
             log("    RELEASE SEARCH");
-            auto release_name_encoded = encode.encode_string(release_name); 
-            if (release_name_encoded.size() == 0) {
+            const EncodedString &release_name_encoded = encode_query(release_name);
+            if (release_name_encoded.encoded.size() == 0) {
                 log("    release name contains no word characters.");
-                return nullptr;
+                results.clear();
+                return;
             }
 
-            vector<IndexResult> *rel_results = release_recording_index->release_index->search(release_name_encoded, .7, 'l');
-            if (rel_results->size()) {
+            release_recording_index->release_index->search(release_name_encoded.encoded, &release_name_encoded.words,
+                                                           .7, 'l', results, ctx);
+            if (results.size()) {
                 // Sort results by confidence in descending order
-                sort(rel_results->begin(), rel_results->end(), [](const IndexResult& a, const IndexResult& b) {
+                sort(results.begin(), results.end(), [](const IndexResult& a, const IndexResult& b) {
                     return a.confidence > b.confidence;
                 });
                 
-                for(auto &result : *rel_results) {
-                    string text = release_recording_index->release_index->get_index_text(result.result_index);
+                for(auto &result : results) {
+                    string text(release_recording_index->release_index->get_index_text(result.result_index));
                     log("      %.2f %-8u %-8d %s", result.confidence, result.id, result.result_index, text.c_str());
                 }     
             }
             else    
                 log("    no release matches, ignoring release.");
 
-            return rel_results;
         }
 
-        vector<IndexResult> *
+        // Replace results with the matches for recording_name, reusing the scratch memory in ctx. Returns true
+        // if they are exact matches only, see FuzzyIndex::search().
+        bool
         recording_search(ReleaseRecordingIndex *release_recording_index, 
-                         const string          &recording_name) {
+                         const string          &recording_name,
+                         vector<IndexResult>   &results,
+                         FuzzySearchContext    &ctx,
+                         bool                   fuzzy_alternatives = false) {
 
             log("    RECORDING SEARCH");
-            auto recording_name_encoded = encode.encode_string(recording_name); 
-            if (recording_name_encoded.size() == 0) {
+            const EncodedString &recording_name_encoded = encode_query(recording_name);
+            if (recording_name_encoded.encoded.size() == 0) {
                 log("    recording name contains no word characters.");
-                return nullptr;
+                results.clear();
+                return false;
             }
 
-            vector<IndexResult> *rec_results = release_recording_index->recording_index->search(recording_name_encoded, .7, 'c');
-            if (rec_results->size()) {
+            bool exact = release_recording_index->recording_index->search(recording_name_encoded.encoded,
+                                                                          &recording_name_encoded.words, .7, 'c', results,
+                                                                          ctx, fuzzy_alternatives);
+            if (results.size()) {
                 // Sort results by confidence in descending order
-                sort(rec_results->begin(), rec_results->end(), [](const IndexResult& a, const IndexResult& b) {
+                sort(results.begin(), results.end(), [](const IndexResult& a, const IndexResult& b) {
                     return a.confidence > b.confidence;
                 });
                 
-                for(auto &result : *rec_results) {
-                    string text = release_recording_index->recording_index->get_index_text(result.result_index);
+                for(auto &result : results) {
+                    string text(release_recording_index->recording_index->get_index_text(result.result_index));
                     log("      %.2f %-8u %s", result.confidence, result.id, text.c_str());
                 }
             } else {
                 log("      No recording results.");
             }
 
-            return rec_results;
+            return exact;
         }
         
         SearchMatch *
@@ -307,6 +307,7 @@ int main(int argc, char* argv[]) {
 
     log("Starting server on %s:%d", host.c_str(), port);
     log("Index directory: %s", g_index_dir.c_str());
+    log("Score kernels: %s", score_kernels().name);
     if (g_num_threads > 0) {
         log("Using %d threads", g_num_threads);
         app.bindaddr(host).port(port).concurrency(g_num_threads).run();
@@ -3,7 +3,11 @@
 #include <sstream>
 #include <algorithm>
 #include <iterator>
+#include <random>
+#include <numeric>
+#include <thread>
 #include "fsm.hpp"
+#include "score_kernels.hpp"
 #include "test_cases.hpp"
 
 #ifdef INFO
@@ -83,6 +87,45 @@ lookup(const string &artist_credit_name, const string &release_name, const strin
     return ret;
 }
 
+// count texts of min_len to max_len characters drawn from a small alphabet, so that trigrams repeat a lot
+vector<string>
+random_texts(unsigned int seed, unsigned int count, unsigned int min_len, unsigned int max_len) {
+    mt19937 rng(seed);
+    vector<string> texts;
+    for(unsigned int i = 0; i < count; i++) {
+        string text;
+        for(unsigned int j = 0, len = min_len + rng() % (max_len - min_len + 1); j < len; j++)
+            text += "abcdefgh "[rng() % 9];
+        texts.push_back(text);
+    }
+    return texts;
+}
+
+vector<unsigned int>
+sequential_ids(size_t count) {
+    vector<unsigned int> ids(count);
+    iota(ids.begin(), ids.end(), 0);
+    return ids;
+}
+
+// Whether two searches found the same documents in the same order, with confidences at most tolerance apart
+bool
+same_results(const vector<IndexResult> &a, const vector<IndexResult> &b, float tolerance = 0.0) {
+    bool same = a.size() == b.size();
+    for(size_t i = 0; same && i < a.size(); i++)
+        same = a[i].id == b[i].id && fabs(a[i].confidence - b[i].confidence) <= tolerance;
+    return same;
+}
+
+void
+require_same_results(const vector<IndexResult> &a, const vector<IndexResult> &b, float tolerance = 0.0) {
+    REQUIRE(a.size() == b.size());
+    for(size_t i = 0; i < a.size(); i++) {
+        REQUIRE(a[i].id == b[i].id);
+        REQUIRE(fabs(a[i].confidence - b[i].confidence) <= tolerance);
+    }
+}
+
 TEST_CASE("basic lookup tests") {
     auto test_case = GENERATE(from_range(get_test_cases()));
 
@@ -99,6 +142,829 @@ TEST_CASE("basic lookup tests") {
     REQUIRE(get<2>(result) == test_case.recording_mbid);
 }
 
+TEST_CASE("score kernel parity") {
+    const ScoreKernels *reference = get_score_kernels(SCORE_KERNELS_SCALAR);
+    REQUIRE(reference != nullptr);
+
+    mt19937 rng(42);
+    uniform_real_distribution<float> weight_dist(0.01, 1.0);
+    const unsigned int num_docs = 5000;
+
+    for(int level = SCORE_KERNELS_AVX2; level < NUM_SCORE_KERNEL_LEVELS; level++) {
+        const ScoreKernels *kernels = get_score_kernels(level);
+        if (kernels == nullptr)
+            continue;
+        INFO("Kernels: " << kernels->name);
+
+        vector<float> expected_acc(num_docs, 0.0), acc(num_docs, 0.0);
+        vector<unsigned int> expected_new, found_new;
+        for(int term = 0; term < 50; term++) {
+            // Posting lists of every length up to a few vector widths, plus some long ones
+            size_t length = term < 40 ? term : rng() % num_docs;
+            vector<unsigned int> ids(num_docs);
+            for(unsigned int i = 0; i < num_docs; i++)
+                ids[i] = i;
+            shuffle(ids.begin(), ids.end(), rng);
+            ids.resize(length);
+            sort(ids.begin(), ids.end());
+            vector<float> weights(length);
+            for(auto &w : weights)
+                w = weight_dist(rng);
+            float query_weight = weight_dist(rng);
+
+            vector<unsigned int> new_docs(length);
+            size_t num_new = reference->accumulate_postings(expected_acc.data(), ids.data(), weights.data(),
+                                                            length, query_weight, new_docs.data());
+            expected_new.insert(expected_new.end(), new_docs.begin(), new_docs.begin() + num_new);
+            num_new = kernels->accumulate_postings(acc.data(), ids.data(), weights.data(),
+                                                   length, query_weight, new_docs.data());
+            found_new.insert(found_new.end(), new_docs.begin(), new_docs.begin() + num_new);
+        }
+        REQUIRE(found_new == expected_new);
+        REQUIRE(acc == expected_acc);
+
+        for(float threshold : { 0.0f, 1.5f, 3.0f, 100.0f }) {
+            vector<float> expected_copy = expected_acc, copy = expected_acc;
+            vector<ScoredDoc> expected_hits(expected_new.size()), hits(expected_new.size());
+            expected_hits.resize(reference->collect_scores(expected_copy.data(), expected_new.data(), expected_new.size(),
+                                                           0.25, threshold, expected_hits.data()));
+            hits.resize(kernels->collect_scores(copy.data(), expected_new.data(), expected_new.size(),
+                                                0.25, threshold, hits.data()));
+            REQUIRE(hits.size() == expected_hits.size());
+            for(size_t i = 0; i < hits.size(); i++) {
+                REQUIRE(hits[i].doc == expected_hits[i].doc);
+                REQUIRE(hits[i].score == expected_hits[i].score);
+            }
+            REQUIRE(copy == vector<float>(num_docs, 0.0));
+        }
+
+        // Every gap width, with block lengths around the vector width
+        for(unsigned int bits = 0; bits <= 32; bits++)
+            for(size_t n : { 1, 2, 8, 9, 17, 128 }) {
+                vector<uint8_t> data((n * bits + 7) / 8 + 8);
+                for(auto &byte : data)
+                    byte = rng();
+                vector<unsigned int> expected_docs(n), docs(n);
+                reference->unpack_doc_ids(data.data(), bits, n, 12345, expected_docs.data());
+                kernels->unpack_doc_ids(data.data(), bits, n, 12345, docs.data());
+                REQUIRE(docs == expected_docs);
+            }
+    }
+}
+
+TEST_CASE("quantised weights never round to zero") {
+    // A common trigram of a long text can weigh less than 1/510 of what it does in a short one
+    float max_weight = .9, tiny = max_weight / 600;
+    uint8_t quantised = quantise_uint8_weight(tiny, max_weight);
+    REQUIRE(quantised == 1);
+    REQUIRE(fabs(quantised * max_weight / 255 - tiny) <= max_weight / 255);
+    REQUIRE(quantise_uint8_weight(max_weight / 2, max_weight) == 128);
+    REQUIRE(half_to_float(quantise_fp16_weight(1e-9)) > 0.0);
+    REQUIRE(quantise_fp16_weight(0.0) == 0);
+
+    // Such a posting is still the first one of its document, so that a second term doesn't make the
+    // document a candidate again
+    const ScoreKernels &kernels = score_kernels();
+    vector<float> accumulator(4, 0.0);
+    unsigned int ids[] = { 2 };
+    float weights[] = { quantised * max_weight / 255 };
+    vector<unsigned int> candidates(2);
+    size_t num_candidates = kernels.accumulate_postings(accumulator.data(), ids, weights, 1, .5, candidates.data());
+    num_candidates += kernels.accumulate_postings(accumulator.data(), ids, weights, 1, .5,
+                                                  candidates.data() + num_candidates);
+    REQUIRE(num_candidates == 1);
+    REQUIRE(candidates[0] == 2);
+}
+
+TEST_CASE("concurrent searches share an index") {
+    mt19937 rng(7);
+    vector<string> texts = random_texts(7, 2000, 3, 27);
+    vector<unsigned int> ids = sequential_ids(texts.size());
+    FuzzyIndex index;
+    index.build(ids, texts);
+
+    // Every other query has trigrams the index has never seen
+    vector<string> queries;
+    for(unsigned int q = 0; q < 200; q++)
+        queries.push_back(q % 2 ? texts[rng() % texts.size()] + "xyz" : texts[rng() % texts.size()]);
+
+    vector<vector<IndexResult>> expected(queries.size());
+    FuzzySearchContext ctx;
+    for(size_t q = 0; q < queries.size(); q++)
+        index.search(queries[q], .5, 's', expected[q], ctx);
+
+    const unsigned int num_threads = 4;
+    vector<unsigned int> mismatches(num_threads, 0);
+    vector<thread> threads;
+    for(unsigned int t = 0; t < num_threads; t++)
+        threads.emplace_back([&, t]() {
+            FuzzySearchContext thread_ctx;
+            vector<IndexResult> results;
+            for(size_t q = 0; q < queries.size(); q++) {
+                index.search(queries[q], .5, 's', results, thread_ctx);
+                mismatches[t] += !same_results(results, expected[q]);
+            }
+        });
+    for(auto &it : threads)
+        it.join();
+
+    REQUIRE(mismatches == vector<unsigned int>(num_threads, 0));
+}
+
+TEST_CASE("parallel vectorisation matches serial") {
+    vector<string> texts = random_texts(11, 5000, 1, 30);
+
+    TfIdfVectorizer serial(false, false), parallel(false, false);
+    arma::sp_mat expected = serial.fit_transform(texts, 1);
+    arma::sp_mat matrix = parallel.fit_transform(texts, 4);
+
+    REQUIRE(parallel.get_idf_() == serial.get_idf_());
+    REQUIRE(matrix.n_cols == expected.n_cols);
+    auto it = matrix.begin(), expected_it = expected.begin();
+    size_t num_values = 0;
+    for(; it != matrix.end() && expected_it != expected.end(); ++it, ++expected_it, num_values++) {
+        REQUIRE(it.row() == expected_it.row());
+        REQUIRE(it.col() == expected_it.col());
+        REQUIRE(*it == *expected_it);
+    }
+    REQUIRE(it == matrix.end());
+    REQUIRE(expected_it == expected.end());
+
+    // The streaming fit and the posting lists it writes agree with the matrix
+    auto document = [&texts](size_t i) { return string_view(texts[i]); };
+    TfIdfVectorizer streamed(false, false);
+    streamed.fit(texts.size(), document, 4);
+    REQUIRE(streamed.get_idf_() == serial.get_idf_());
+
+    vector<unsigned int> offsets, ids, expected_offsets, expected_ids;
+    vector<float> weights, expected_weights;
+    streamed.transform_postings(texts.size(), document, expected_offsets, expected_ids, expected_weights, 1);
+    streamed.transform_postings(texts.size(), document, offsets, ids, weights, 4);
+    REQUIRE(offsets == expected_offsets);
+    REQUIRE(ids == expected_ids);
+    REQUIRE(weights == expected_weights);
+    REQUIRE(offsets.back() == num_values);
+}
+
+TEST_CASE("MaxScore finds what a brute-force dot product does") {
+    mt19937 rng(13);
+    vector<string> texts = random_texts(13, 1500, 3, 27);
+    vector<unsigned int> ids = sequential_ids(texts.size());
+    FuzzyIndex index;
+    index.build(ids, texts);
+    TfIdfVectorizer vectorizer(false, false);
+    arma::sp_mat matrix = vectorizer.fit_transform(texts);
+
+    FuzzySearchContext ctx;
+    vector<IndexResult> results;
+    vector<pair<size_t, double>> features;
+    for(unsigned int q = 0; q < 100; q++) {
+        string query = texts[rng() % texts.size()];
+        if (q % 2)
+            query[rng() % query.size()] = 'x';
+
+        // Score every document, and keep what select_results() keeps: all perfect matches and the best of the rest
+        vectorizer.transform_query(query, features);
+        map<size_t, double> weights(features.begin(), features.end());
+        vector<double> scores(texts.size(), 0.0);
+        for(auto it = matrix.begin(); it != matrix.end(); ++it) {
+            auto weight = weights.find(it.row());
+            if (weight != weights.end())
+                scores[it.col()] += weight->second * *it;
+        }
+        vector<pair<double, unsigned int>> expected;
+        for(unsigned int doc = 0; doc < texts.size(); doc++)
+            if (scores[doc] >= .5)
+                expected.push_back({ scores[doc], doc });
+        sort(expected.begin(), expected.end(), [](const pair<double, unsigned int> &a, const pair<double, unsigned int> &b) {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        });
+        size_t num_perfect = count_if(expected.begin(), expected.end(), [](const pair<double, unsigned int> &e) {
+            return e.first >= PERFECT_MATCH_CONFIDENCE;
+        });
+        size_t num_results = (num_perfect / NUM_FUZZY_SEARCH_RESULTS + 1) * NUM_FUZZY_SEARCH_RESULTS;
+
+        index.search(query, .5, 's', results, ctx, true);
+        REQUIRE(results.size() == min(expected.size(), num_results));
+        for(size_t i = 0; i < results.size(); i++) {
+            REQUIRE(fabs(results[i].confidence - expected[i].first) < 1e-5);
+            // Scores that float rounding may put in either order can't tell which document comes first
+            bool apart = (i == 0 || expected[i - 1].first - expected[i].first > 1e-5) &&
+                         (i + 1 == expected.size() || expected[i].first - expected[i + 1].first > 1e-5);
+            if (apart)
+                REQUIRE(results[i].id == expected[i].second);
+        }
+    }
+}
+
+TEST_CASE("every perfect match is returned") {
+    // More identical texts than a search returns results, among others that are near and far
+    vector<string> texts;
+    vector<unsigned int> ids;
+    for(unsigned int i = 0; i < NUM_FUZZY_SEARCH_RESULTS + 5; i++)
+        texts.push_back("intro");
+    for(const char *text : { "intros", "introit", "outro", "interlude", "reprise" })
+        texts.push_back(text);
+    for(unsigned int i = 0; i < texts.size(); i++)
+        ids.push_back(100 + i);
+    FuzzyIndex index;
+    index.build(ids, texts);
+
+    FuzzySearchContext ctx;
+    vector<IndexResult> results;
+    unsigned long expansions = FuzzyIndex::get_expansion_count();
+    index.search("intro", .1, 's', results, ctx, true);
+    REQUIRE(FuzzyIndex::get_expansion_count() == expansions + 1);
+    REQUIRE(results.size() > NUM_FUZZY_SEARCH_RESULTS + 5);
+    for(unsigned int i = 0; i < NUM_FUZZY_SEARCH_RESULTS + 5; i++) {
+        REQUIRE(results[i].id == 100 + i);
+        REQUIRE(results[i].confidence >= PERFECT_MATCH_CONFIDENCE);
+    }
+    REQUIRE(results[NUM_FUZZY_SEARCH_RESULTS + 5].confidence < PERFECT_MATCH_CONFIDENCE);
+
+    // Fewer ties than that don't need the search to look further
+    expansions = FuzzyIndex::get_expansion_count();
+    index.search("intros", .1, 's', results, ctx, true);
+    REQUIRE(FuzzyIndex::get_expansion_count() == expansions);
+    REQUIRE(results.size() == NUM_FUZZY_SEARCH_RESULTS);
+
+    // Exact matches are counted too, as long as there are as many
+    expansions = FuzzyIndex::get_expansion_count();
+    REQUIRE(index.search("intro", .1, 's', results, ctx));
+    REQUIRE(FuzzyIndex::get_expansion_count() == expansions + 1);
+    REQUIRE(results.size() == NUM_FUZZY_SEARCH_RESULTS + 5);
+    REQUIRE(index.search("outro", .1, 's', results, ctx));
+    REQUIRE(FuzzyIndex::get_expansion_count() == expansions + 1);
+}
+
+TEST_CASE("indexes share a vocabulary") {
+    mt19937 rng(5);
+    vector<string> texts = random_texts(5, 1000, 3, 27);
+    vector<unsigned int> ids = sequential_ids(texts.size());
+
+    // A vocabulary fitted to the same texts finds exactly what the index's own one does
+    auto vocabulary = make_shared<TfIdfVectorizer>(false, false);
+    vocabulary->fit(texts);
+    FuzzyIndex own, shared;
+    own.build(ids, texts);
+    shared.build(ids, texts, vocabulary);
+    shared.quantise_weights(WEIGHT_FORMAT_PACKED);
+
+    // The vocabulary isn't saved with the index
+    std::stringstream ss;
+    {
+        cereal::BinaryOutputArchive oarchive(ss);
+        oarchive(shared);
+    }
+    FuzzyIndex loaded;
+    {
+        cereal::BinaryInputArchive iarchive(ss);
+        iarchive(loaded);
+    }
+    REQUIRE(loaded.needs_vocabulary());
+    // Nor can it use any other one, such as a vocabulary fitted again to the texts as they are later
+    auto refitted = make_shared<TfIdfVectorizer>(false, false);
+    refitted->fit(vector<string>(texts.begin() + 1, texts.end()));
+    REQUIRE(refitted->fingerprint() != vocabulary->fingerprint());
+    REQUIRE(!loaded.use_vocabulary(refitted));
+    REQUIRE(!loaded.use_vocabulary(make_shared<TfIdfVectorizer>()));
+    REQUIRE(loaded.needs_vocabulary());
+    // The vocabulary loaded from where it is saved is the same one
+    std::stringstream vocabulary_ss;
+    {
+        cereal::BinaryOutputArchive oarchive(vocabulary_ss);
+        oarchive(*vocabulary);
+    }
+    auto saved = make_shared<TfIdfVectorizer>(false, false);
+    {
+        cereal::BinaryInputArchive iarchive(vocabulary_ss);
+        iarchive(*saved);
+    }
+    REQUIRE(saved->fingerprint() == vocabulary->fingerprint());
+    REQUIRE(loaded.use_vocabulary(saved));
+    REQUIRE(!loaded.needs_vocabulary());
+
+    FuzzySearchContext ctx;
+    vector<IndexResult> expected, results;
+    for(unsigned int q = 0; q < 200; q++) {
+        string query = q % 2 ? texts[rng() % texts.size()] + "xyz" : texts[rng() % texts.size()];
+        own.search(query, .5, 's', expected, ctx);
+        loaded.search(query, .5, 's', results, ctx);
+        require_same_results(results, expected);
+    }
+}
+
+TEST_CASE("index blobs carry their format") {
+    vector<string> texts = { "portishead", "massive attack", "tricky" };
+    vector<unsigned int> ids = { 1, 2, 3 };
+    FuzzyIndex index;
+    index.build(ids, texts);
+    std::stringstream ss;
+    {
+        cereal::BinaryOutputArchive oarchive(ss);
+        oarchive(index);
+    }
+    string blob = ss.str();
+
+    auto load = [](const string &data, FuzzyIndex &loaded) {
+        std::stringstream in(data);
+        cereal::BinaryInputArchive iarchive(in);
+        iarchive(loaded);
+    };
+    FuzzyIndex loaded;
+    load(blob, loaded);
+    FuzzySearchContext ctx;
+    vector<IndexResult> results;
+    loaded.search("massive attack", .5, 's', results, ctx);
+    REQUIRE(results.size() == 1);
+    REQUIRE(results[0].id == 2);
+
+    // Blobs of another format or cut short are refused, and leave the index empty
+    string old_format = blob;
+    old_format[4]++;
+    REQUIRE_THROWS(load(old_format, loaded));
+    REQUIRE_THROWS(load(blob.substr(0, blob.size() / 2), loaded));
+    REQUIRE_THROWS(load(blob.substr(0, 6), loaded));
+    loaded.search("massive attack", .5, 's', results, ctx);
+    REQUIRE(results.empty());
+
+    // An index whose build failed still loads, empty
+    FuzzyIndex never_built;
+    std::stringstream empty;
+    {
+        cereal::BinaryOutputArchive oarchive(empty);
+        oarchive(never_built);
+    }
+    load(empty.str(), loaded);
+}
+
+TEST_CASE("n-gram sizes and norms") {
+    vector<string> texts = { "a", "ab", "abc", "abcabc", "bcd bcd", "dcba" };
+    for(unsigned int n = 1; n <= TfIdfVectorizer::MAX_NGRAM_SIZE; n++)
+        for(string norm : { "l1", "l2" }) {
+            TfIdfVectorizer vectorizer(false, false, true, -1, norm, false, n);
+            arma::sp_mat matrix = vectorizer.fit_transform(texts);
+            for(auto &it : vectorizer.get_vocabulary_())
+                REQUIRE(it.first.size() == n);
+
+            // transform_query gives the columns of transform, and they have unit norm
+            vector<pair<size_t, double>> features;
+            for(size_t d = 0; d < texts.size(); d++) {
+                vectorizer.transform_query(texts[d], features);
+                REQUIRE(features.size() > 0);
+                double sum = 0.0;
+                for(auto &f : features) {
+                    REQUIRE(matrix(f.first, d) == f.second);
+                    sum += norm == "l1" ? f.second : f.second * f.second;
+                }
+                REQUIRE(fabs(sum - 1.0) < 1e-9);
+            }
+        }
+}
+
+TEST_CASE("table encoding matches the regex pipeline") {
+    EncodeSearchData encode;
+    vector<string> texts = { "", "The Beatles", "Hey_Jude - Remastered 2009!", "Beyoncé", "Sigur Rós", "Motörhead",
+                             "Ænima", "Straße", "Мумий Тролль", "椎名林檎", "ヨルシカ", "אביב גפן", "Ørjan Nilsen…",
+                             "Mötley Crüe", "Łona", "🎵 music 🎶", "Kid A (Collector’s Edition)", "𝄞 Clef" };
+    string out;
+    for(auto &text : texts) {
+        encode.encode_string(text, out);
+        REQUIRE(out == encode.encode_string_regex(text));
+        REQUIRE(encode.encode_string(text) == out);
+    }
+}
+
+TEST_CASE("cached query words search like the text") {
+    vector<string> texts = { "heyjude", "letitbe", "yesterday", "help", "somethingnew", "abbeyroad", "a" };
+    vector<unsigned int> ids = { 1, 2, 3, 4, 5, 6, 7 };
+    FuzzyIndex index;
+    index.build(ids, texts);
+
+    EncodeSearchData encode;
+    EncodeCache cache(encode);
+    FuzzySearchContext ctx;
+    vector<IndexResult> expected, results;
+    for(string query : { "Hey Jude!", "Let It Be", "Yesterday (Remastered)", "Help", "Hey Jude!", "A" }) {
+        const EncodedString &encoded = cache.lookup(query);
+        REQUIRE(encoded.encoded == encode.encode_string(query));
+        index.search(encoded.encoded, .5, 's', expected, ctx);
+        index.search(encoded.encoded, &encoded.words, .5, 's', results, ctx);
+        require_same_results(results, expected);
+    }
+    REQUIRE(cache.get_hits() == 1);
+}
+
+TEST_CASE("quantised weights search like float ones") {
+    mt19937 rng(19);
+    vector<string> texts = random_texts(19, 2000, 3, 29);
+    vector<unsigned int> ids = sequential_ids(texts.size());
+    // Long enough posting lists for packed ones to have several blocks, and queries that score them all
+    for(unsigned int i = 0; i < 300; i++) {
+        texts.push_back("abcabc" + texts[i]);
+        ids.push_back(ids.size());
+    }
+    vector<string> queries;
+    for(unsigned int q = 0; q < 200; q++) {
+        string query = texts[rng() % texts.size()];
+        query[rng() % query.size()] = "abcdefgh "[rng() % 9];
+        queries.push_back(q % 10 ? query : "abcabc");
+    }
+
+    FuzzyIndex float_index;
+    float_index.build(ids, texts);
+    FuzzySearchContext ctx;
+    vector<vector<IndexResult>> expected(queries.size());
+    for(size_t q = 0; q < queries.size(); q++)
+        float_index.search(queries[q], .5, 's', expected[q], ctx, true);
+
+    for(int format : { WEIGHT_FORMAT_FP16, WEIGHT_FORMAT_UINT8, WEIGHT_FORMAT_PACKED }) {
+        FuzzyIndex index;
+        index.build(ids, texts);
+        REQUIRE(index.quantise_weights(format));
+        vector<IndexResult> results;
+        for(size_t q = 0; q < queries.size(); q++) {
+            index.search(queries[q], .5, 's', results, ctx, true);
+            require_same_results(results, expected[q], 1e-5);
+        }
+    }
+}
+
+TEST_CASE("merged changes search like the changed index") {
+    mt19937 rng(9);
+    vector<string> texts = random_texts(9, 1500, 3, 27);
+    vector<unsigned int> ids = sequential_ids(texts.size());
+    vector<string> queries;
+    for(unsigned int q = 0; q < 100; q++)
+        queries.push_back(q % 2 ? texts[rng() % texts.size()] + "ab" : texts[rng() % texts.size()]);
+
+    auto search_all = [&queries](FuzzyIndex &index) {
+        FuzzySearchContext ctx;
+        vector<vector<IndexResult>> all(queries.size());
+        for(size_t q = 0; q < queries.size(); q++)
+            index.search(queries[q], .5, 's', all[q], ctx, true);
+        return all;
+    };
+    auto require_same = [](const vector<vector<IndexResult>> &a, const vector<vector<IndexResult>> &b) {
+        REQUIRE(a.size() == b.size());
+        for(size_t q = 0; q < a.size(); q++)
+            require_same_results(a[q], b[q], 1e-5);
+    };
+
+    for(int format : { WEIGHT_FORMAT_FLOAT, WEIGHT_FORMAT_FP16, WEIGHT_FORMAT_UINT8, WEIGHT_FORMAT_PACKED }) {
+        FuzzyIndex index;
+        index.build(ids, texts);
+        REQUIRE(index.quantise_weights(format));
+        // Quantised weights stay as they are, and there is no format 17
+        REQUIRE(index.quantise_weights(format));
+        REQUIRE(!index.quantise_weights(format == WEIGHT_FORMAT_FLOAT ? 17 : WEIGHT_FORMAT_FLOAT));
+        auto original = search_all(index);
+
+        // Removing documents and adding them back as they were changes nothing, merged or not
+        vector<unsigned int> removed = { 3, 50, 51, 700, 1499 };
+        REQUIRE(index.remove_documents(removed) == removed.size());
+        for(auto id : removed)
+            REQUIRE(index.add_document(id, texts[id]));
+        require_same(search_all(index), original);
+        REQUIRE(index.merge_delta());
+        REQUIRE(index.num_pending_changes() == 0);
+        require_same(search_all(index), original);
+
+        // New documents and removals find the same before and after the merge
+        for(unsigned int i = 0; i < 40; i++)
+            index.add_document(10000 + i, texts[rng() % texts.size()] + "h");
+        index.remove_documents({ 10, 11, 12, 10005 });
+        auto changed = search_all(index);
+        REQUIRE(index.merge_delta());
+        require_same(search_all(index), changed);
+    }
+}
+
+TEST_CASE("exact matches skip scoring") {
+    vector<string> texts = { "heyjude", "heyjudes", "letitbe", "heyjude", "yesterday" };
+    vector<unsigned int> ids = { 1, 2, 3, 4, 5 };
+    FuzzyIndex index;
+    index.build(ids, texts);
+
+    FuzzySearchContext ctx;
+    vector<IndexResult> results;
+    REQUIRE(index.search("heyjude", .5, 's', results, ctx));
+    REQUIRE(results.size() == 2);
+    REQUIRE(results[0].id == 1);
+    REQUIRE(results[1].id == 4);
+    REQUIRE(results[0].confidence == 1.0);
+
+    // Fuzzy alternatives include the near matches too
+    REQUIRE(!index.search("heyjude", .5, 's', results, ctx, true));
+    REQUIRE(results.size() == 3);
+    REQUIRE(!index.search("heyjud", .5, 's', results, ctx));
+    REQUIRE(results.size() > 0);
+
+    // Added and removed documents are matched exactly before they are merged, and after
+    index.add_document(6, "letitbe");
+    index.remove_documents({ 3 });
+    for(int merged = 0; merged < 2; merged++) {
+        REQUIRE(index.search("letitbe", .5, 's', results, ctx));
+        REQUIRE(results.size() == 1);
+        REQUIRE(results[0].id == 6);
+        index.merge_delta();
+    }
+}
+
+TEST_CASE("long queries are compared with the full texts") {
+    // The first 30 characters, which is all the TF-IDF vectors see, don't tell these apart
+    string start = "abcdefghijklmnopqrstuvwxyz0123";
+    vector<string> texts = { start + "alpha", start + "omegaomegaomega", "x" + start.substr(1) + "alpha", "short" };
+    vector<unsigned int> ids = { 1, 2, 3, 4 };
+    FuzzyIndex index;
+    index.build(ids, texts);
+
+    FuzzySearchContext ctx;
+    vector<IndexResult> results;
+    // A substitution costs two edits
+    index.search(start + "alph", .9, 's', results, ctx);
+    REQUIRE(results.size() == 2);
+    REQUIRE(results[0].id == 1);
+    REQUIRE(fabs(results[0].confidence - (1.0 - 1.0 / 34)) < 1e-6);
+    REQUIRE(results[1].id == 3);
+    REQUIRE(fabs(results[1].confidence - (1.0 - 3.0 / 34)) < 1e-6);
+}
+
+TEST_CASE("index files load what was saved and nothing else") {
+    mt19937 rng(17);
+    vector<string> texts = random_texts(17, 500, 3, 42);
+    vector<unsigned int> ids = sequential_ids(texts.size());
+    // Lists long enough to have a skip table when they are packed
+    for(unsigned int i = 0; i < 300; i++) {
+        texts.push_back("qqq" + texts[i]);
+        ids.push_back(500 + i);
+    }
+    vector<string> queries;
+    for(unsigned int q = 0; q < 50; q++)
+        queries.push_back(texts[rng() % texts.size()].substr(1));
+
+    string path = "/tmp/fuzzy_index_test_" + to_string(getpid()) + ".idx";
+    auto read_file = [&path]() {
+        string data;
+        FILE *fp = fopen(path.c_str(), "rb");
+        char buffer[4096];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+            data.append(buffer, count);
+        fclose(fp);
+        return data;
+    };
+    auto write_file = [&path](const string &data) {
+        FILE *fp = fopen(path.c_str(), "wb");
+        fwrite(data.data(), 1, data.size(), fp);
+        fclose(fp);
+    };
+    // A file that doesn't load leaves nothing to search
+    auto rejected = [&path, &queries]() {
+        FuzzyIndex index;
+        FuzzySearchContext ctx;
+        vector<IndexResult> results;
+        if (index.load_index_file(path))
+            return false;
+        for(auto &query : queries)
+            if (index.search(query, .1, 's', results, ctx, true) || results.size())
+                return false;
+        return true;
+    };
+
+    for(int format : { WEIGHT_FORMAT_FLOAT, WEIGHT_FORMAT_PACKED }) {
+        FuzzyIndex index;
+        index.build(ids, texts);
+        REQUIRE(index.quantise_weights(format));
+        REQUIRE(index.save_index_file(path));
+
+        FuzzyIndex loaded;
+        REQUIRE(loaded.load_index_file(path));
+        FuzzySearchContext ctx;
+        vector<IndexResult> built, results;
+        for(auto &query : queries) {
+            index.search(query, .5, 's', built, ctx);
+            loaded.search(query, .5, 's', results, ctx);
+            require_same_results(results, built);
+        }
+
+        string data = read_file();
+        write_file(data.substr(0, data.size() / 2));
+        REQUIRE(rejected());
+
+        string corrupt = data;
+        corrupt[0] ^= 0xff;
+        write_file(corrupt);
+        REQUIRE(rejected());
+
+        // Values that point past other arrays, behind a valid header and section table
+        auto section_of = [&data](unsigned int i) {
+            IndexFileSection section;
+            memcpy(&section, data.data() + sizeof(IndexFileHeader) + i * sizeof(IndexFileSection), sizeof(section));
+            return section;
+        };
+        auto write_corrupt_section = [&data, &write_file, &section_of](unsigned int i, size_t at, auto value) {
+            string corrupt = data;
+            memcpy(&corrupt[section_of(i).offset + at], &value, sizeof(value));
+            write_file(corrupt);
+        };
+        write_corrupt_section(FUZZY_SECTION_POSTING_OFFSETS, section_of(FUZZY_SECTION_POSTING_OFFSETS).size - sizeof(uint32_t),
+                              0xfffffff0);
+        REQUIRE(rejected());
+        if (format == WEIGHT_FORMAT_FLOAT) {
+            write_corrupt_section(FUZZY_SECTION_POSTING_IDS, 0, (uint32_t)texts.size());
+            REQUIRE(rejected());
+        }
+        else {
+            // Damage packed lists found through the offsets of their postings and of their bytes
+            auto read_offset = [&data, &section_of](unsigned int i, size_t t) {
+                uint32_t value;
+                memcpy(&value, data.data() + section_of(i).offset + t * sizeof(uint32_t), sizeof(value));
+                return value;
+            };
+            const uint8_t *blocks = (const uint8_t *)data.data() + section_of(FUZZY_SECTION_POSTING_WEIGHTS).offset;
+            size_t num_terms = section_of(FUZZY_SECTION_POSTING_OFFSETS).size / sizeof(uint32_t) - 1;
+            bool skip = false, width = false, doc = false;
+            for(size_t t = 0; t < num_terms; t++) {
+                size_t count = read_offset(FUZZY_SECTION_POSTING_OFFSETS, t + 1) - read_offset(FUZZY_SECTION_POSTING_OFFSETS, t);
+                uint32_t start = read_offset(FUZZY_SECTION_POSTING_IDS, t);
+                uint32_t length = read_offset(FUZZY_SECTION_POSTING_IDS, t + 1) - start;
+                if (count > POSTING_BLOCK_SIZE && !skip) {
+                    // The second block starting past the end of its list
+                    write_corrupt_section(FUZZY_SECTION_POSTING_WEIGHTS, start + 3 * sizeof(uint32_t), length);
+                    REQUIRE(rejected());
+                    skip = true;
+                }
+                else if (count > 1 && count <= POSTING_BLOCK_SIZE && !width) {
+                    // Gaps wider than a document id, after the varint of the first document
+                    uint32_t at = start;
+                    while (blocks[at] & 0x80)
+                        at++;
+                    write_corrupt_section(FUZZY_SECTION_POSTING_WEIGHTS, at + 1, (uint8_t)40);
+                    REQUIRE(rejected());
+                    width = true;
+                }
+                else if (count <= POSTING_BLOCK_SIZE && (blocks[start] & 0x80) && !(blocks[start + 1] & 0x80) && !doc) {
+                    // A first document of 16383, past the last one
+                    write_corrupt_section(FUZZY_SECTION_POSTING_WEIGHTS, start, (uint16_t)0x7fff);
+                    REQUIRE(rejected());
+                    doc = true;
+                }
+            }
+            REQUIRE((skip && width && doc));
+        }
+
+        unlink(path.c_str());
+        REQUIRE(rejected());
+    }
+}
+
+TEST_CASE("long text filters are saved with the index") {
+    string start = "abcdefghijklmnopqrstuvwxyz0123";
+    string path = "/tmp/fuzzy_index_test_" + to_string(getpid()) + ".idx";
+    vector<vector<string>> corpora = {
+        { start + "alpha", start + "omegaomegaomega", "x" + start.substr(1) + "alpha", "short" },
+        { "Tokyo 東京事変の教育とスポーツ", "Tokyo 東京事変の歌", start + "alpha", "short" }
+    };
+    vector<string> queries = { start + "alph", "Tokyo 東京事の教育とスポーツ", start + "omegaomega" };
+
+    for(auto &texts : corpora) {
+        vector<unsigned int> ids = { 1, 2, 3, 4 };
+        FuzzyIndex index;
+        index.build(ids, texts);
+        FuzzySearchContext ctx;
+        vector<vector<IndexResult>> built(queries.size());
+        for(size_t q = 0; q < queries.size(); q++)
+            index.search(queries[q], .7, 's', built[q], ctx);
+        REQUIRE(built[0].size() > 0);
+
+        REQUIRE(index.save_index_file(path));
+        FuzzyIndex loaded;
+        REQUIRE(loaded.load_index_file(path));
+        unlink(path.c_str());
+        vector<IndexResult> results;
+        for(size_t q = 0; q < queries.size(); q++) {
+            loaded.search(queries[q], .7, 's', results, ctx);
+            require_same_results(results, built[q]);
+        }
+
+        // A merge indexes the added texts for long queries too
+        REQUIRE(loaded.add_document(5, queries[2]));
+        REQUIRE(loaded.merge_delta());
+        loaded.search(queries[2], .99, 's', results, ctx, true);
+        REQUIRE(results.size() == 1);
+        REQUIRE(results[0].id == 5);
+    }
+}
+
+TEST_CASE("bit-parallel edit distance matches the dynamic programming one") {
+    mt19937 rng(3);
+    LevPattern pattern;
+    for(unsigned int i = 0; i < 2000; i++) {
+        // Short and long patterns, over small alphabets that make for long common subsequences
+        string a, b;
+        for(unsigned int j = 0, len = rng() % (i % 4 ? 70 : 200); j < len; j++)
+            a += "abc\xff"[rng() % 4];
+        for(unsigned int j = 0, len = rng() % (i % 4 ? 70 : 200); j < len; j++)
+            b += "abc\xff"[rng() % 4];
+        pattern.set(a.size(), (const lev_byte*)a.data());
+        REQUIRE(pattern.distance(b.size(), (const lev_byte*)b.data()) ==
+                lev_edit_distance(a.size(), (const lev_byte*)a.data(), b.size(), (const lev_byte*)b.data(), 1));
+    }
+}
+
+TEST_CASE("bounded edit distances") {
+    mt19937 rng(5);
+    LevPattern pattern;
+    for(unsigned int i = 0; i < 2000; i++) {
+        string a, b;
+        for(unsigned int j = 0, len = rng() % (i % 4 ? 70 : 200); j < len; j++)
+            a += "abc"[rng() % 3];
+        b = a;
+        for(unsigned int e = rng() % 30; e > 0 && b.size(); e--)
+            b.erase(rng() % b.size(), 1);
+        size_t max_distance = rng() % 30;
+        size_t dist = lev_edit_distance(a.size(), (const lev_byte*)a.data(), b.size(), (const lev_byte*)b.data(), 1);
+        pattern.set(a.size(), (const lev_byte*)a.data());
+        REQUIRE(pattern.distance(b.size(), (const lev_byte*)b.data(), max_distance) == min(dist, max_distance + 1));
+    }
+}
+
+TEST_CASE("bit-parallel edit distance over code points") {
+    mt19937 rng(7);
+    LevPattern pattern;
+    // Latin-1 characters have a row of their own, the others go through the hash table
+    uint32_t alphabet[] = { 'a', 0xe9, 0x3042, 0x3044, 0x1f3b5, 0x5d0, 0x10000 + 0x3042 };
+    for(unsigned int i = 0; i < 2000; i++) {
+        vector<uint32_t> a, b;
+        for(unsigned int j = 0, len = rng() % (i % 4 ? 70 : 200); j < len; j++)
+            a.push_back(alphabet[rng() % 7]);
+        for(unsigned int j = 0, len = rng() % (i % 4 ? 70 : 200); j < len; j++)
+            b.push_back(alphabet[rng() % 7]);
+        vector<lev_wchar> wa(a.begin(), a.end()), wb(b.begin(), b.end());
+        size_t dist = lev_u_edit_distance(wa.size(), wa.data(), wb.size(), wb.data(), 1);
+        pattern.set(a.size(), a.data());
+        REQUIRE(pattern.distance(b.size(), b.data()) == dist);
+        REQUIRE(pattern.distance(b.size(), b.data(), 10) == min(dist, (size_t)11));
+    }
+}
+
+TEST_CASE("long non-Latin queries count characters") {
+    string text = "Tokyo 東京事変の教育とスポーツ";
+    vector<string> texts = { text, "Tokyo 東京事変の歌", "short" };
+    vector<unsigned int> ids = { 1, 2, 3 };
+    FuzzyIndex index;
+    index.build(ids, texts);
+
+    FuzzySearchContext ctx;
+    vector<IndexResult> results;
+    // One of 17 characters is missing, though it is three of 39 bytes
+    string query = "Tokyo 東京事の教育とスポーツ";
+    index.search(query, .93, 's', results, ctx);
+    REQUIRE(results.size() == 1);
+    REQUIRE(results[0].id == 1);
+    REQUIRE(fabs(results[0].confidence - (1.0 - 1.0 / 17)) < 1e-6);
+}
+
+TEST_CASE("memory budget") {
+    MemoryBudget budget(100);
+    atomic<int> running(0), most(0);
+    vector<thread> threads;
+    for(int i = 0; i < 4; i++) {
+        budget.acquire(60);
+        threads.push_back(thread([&]() {
+            most = max(most.load(), ++running);
+            this_thread::sleep_for(chrono::milliseconds(5));
+            running--;
+            budget.release(60);
+        }));
+    }
+    for(auto &it : threads)
+        it.join();
+    REQUIRE(most == 1);
+
+    // One build always runs, however large
+    budget.acquire(500);
+    budget.release(500);
+}
+
+TEST_CASE("postgres arrays") {
+    vector<string> elements;
+    REQUIRE(parse_pg_array("{Beatles,\"Beatles, The\",\"say \\\"hi\\\"\",\"back\\\\slash\",\"\"}", elements) == 5);
+    REQUIRE(elements[0] == "Beatles");
+    REQUIRE(elements[1] == "Beatles, The");
+    REQUIRE(elements[2] == "say \"hi\"");
+    REQUIRE(elements[3] == "back\\slash");
+    REQUIRE(elements[4] == "");
+
+    // The strings are reused from one array to the next
+    REQUIRE(parse_pg_array("{\" & \"}", elements) == 1);
+    REQUIRE(elements[0] == " & ");
+    REQUIRE(parse_pg_array("{}", elements) == 0);
+    REQUIRE(elements.empty());
+    REQUIRE(parse_pg_array("not an array", elements) == 0);
+}
+
 int main(int argc, char* argv[]) {
     init_logging();
     
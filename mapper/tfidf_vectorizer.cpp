@@ -10,11 +10,94 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 Original source from: https://github.com/phfaustini/TfidfVectorizer
  */
 #include <stdio.h>
+#include <algorithm>
+#include <thread>
 #include "tfidf_vectorizer.hpp"
 
+// Split [0, num_items) into up to num_threads contiguous shards and call work(shard, begin, end) for each
+// on its own thread. The first shard runs on the calling thread. Returns the number of shards.
+template <typename Work>
+static size_t run_shards(size_t num_items, unsigned int num_threads, Work work)
+{
+    size_t num_shards = std::max((size_t)1, std::min((size_t)num_threads, num_items));
+    std::vector<std::thread> threads;
+    for (size_t s = 1; s < num_shards; s++)
+        threads.emplace_back([&, s]() {
+            work(s, num_items * s / num_shards, num_items * (s + 1) / num_shards);
+        });
+    work(0, 0, num_items / num_shards);
+    for (auto& thread : threads)
+        thread.join();
+    return num_shards;
+}
+
+// Words are the n-grams of a document, packed into integers with the first byte highest. Codes sort in the
+// same order as the n-grams they encode.
+template <unsigned int N>
+static inline uint32_t ngram_code(std::string_view document, size_t i)
+{
+    uint32_t code = 0;
+    for (unsigned int k = 0; k < N; k++)
+        code = (code << 8) | (uint8_t)document[i + k];
+    return code;
+}
+
+// Short documents are padded with spaces to a single word, which padded holds
+template <unsigned int N>
+static inline std::string_view pad_document(std::string_view document, char (&padded)[N])
+{
+    if (document.length() >= N)
+        return document;
+    for (size_t i = 0; i < N; i++)
+        padded[i] = i < document.length() ? document[i] : ' ';
+    return std::string_view(padded, N);
+}
+
+// Vector norms, accumulated one element at a time in feature order
+struct L2Norm
+{
+    static double add(double sum, double value) { return sum + value * value; }
+    static double finish(double sum) { return std::sqrt(sum); }
+};
+
+struct L1Norm
+{
+    static double add(double sum, double value) { return sum + std::fabs(value); }
+    static double finish(double sum) { return sum; }
+};
+
+struct NoNorm
+{
+    static double add(double sum, double value) { return sum; }
+    static double finish(double sum) { return 0; }
+};
+
+// Call work(n, norm) with the n-gram size as a std::integral_constant and the norm as one of the structs above
+template <typename Work>
+void TfIdfVectorizer::specialise(Work work) const
+{
+    auto with_norm = [&](auto n) {
+        if (this->p == 2)
+            work(n, L2Norm());
+        else if (this->p == 1)
+            work(n, L1Norm());
+        else
+            work(n, NoNorm());
+    };
+    switch (this->ngram_size)
+    {
+        case 1: with_norm(std::integral_constant<unsigned int, 1>()); break;
+        case 2: with_norm(std::integral_constant<unsigned int, 2>()); break;
+        case 3: with_norm(std::integral_constant<unsigned int, 3>()); break;
+        default: with_norm(std::integral_constant<unsigned int, 4>()); break;
+    }
+}
 
-TfIdfVectorizer::TfIdfVectorizer(bool binary, bool lowercase, bool use_idf, int max_features, std::string norm, bool sublinear_tf)
+TfIdfVectorizer::TfIdfVectorizer(bool binary, bool lowercase, bool use_idf, int max_features, std::string norm, bool sublinear_tf,
+                                 unsigned int ngram_size)
 {
+    if (ngram_size < 1 || ngram_size > MAX_NGRAM_SIZE)
+        throw std::invalid_argument("n-gram size must be between 1 and 4");
     this->binary = binary;
     this->max_features = max_features; // -1 uses all words.
     if (norm == "l2") this->p = 2;
@@ -23,215 +106,478 @@ TfIdfVectorizer::TfIdfVectorizer(bool binary, bool lowercase, bool use_idf, int
     this->lowercase = lowercase;
     this->use_idf = use_idf;
     this->sublinear_tf = sublinear_tf;
+    this->ngram_size = ngram_size;
+    compute_fingerprint();
 }
 
-std::vector<std::string> TfIdfVectorizer::tokenise_document(std::string& document)
+template <unsigned int N>
+void TfIdfVectorizer::tokenise_document(std::string_view document, std::vector<uint32_t>& codes) const
 {
-    std::vector<std::string> tokens;
-   
-    auto l = document.length();
-    if (l < 3) {
-        auto d = document;
-        while(d.size() < 3)
-            d += std::string(" ");
-        tokens.push_back(d);
-    }
-    else
-        for(int i = 0; i < l - 2; i++) {
-            tokens.push_back(document.substr(i, 3));
-        }
-
-    return tokens;
+    char padded[N];
+    document = pad_document<N>(document, padded);
+    codes.clear();
+    for (size_t i = 0; i + N <= document.length(); i++)
+        codes.push_back(ngram_code<N>(document, i));
 }
 
-std::vector<std::vector<std::string>> TfIdfVectorizer::tokenise_documents(std::vector<std::string>& documents)
+// The feature number of a word, or vocabulary_.size() if it is not in the vocabulary
+size_t TfIdfVectorizer::feature(uint32_t code) const
 {
-    std::vector<std::vector<std::string>> documents_tokenised;
-    for (size_t i = 0; i < documents.size(); i++)
-        documents_tokenised.push_back(tokenise_document(documents[i]));
-    return documents_tokenised;
+    auto it = std::lower_bound(this->vocabulary_.begin(), this->vocabulary_.end(), code);
+    if (it == this->vocabulary_.end() || *it != code)
+        return this->vocabulary_.size();
+    return it - this->vocabulary_.begin();
 }
 
-std::vector<std::map<std::string, int>> TfIdfVectorizer::word_count(std::vector<std::vector<std::string>>& documents_tokenised)
+// Add the sorted (word, count) runs of b to those of a
+void TfIdfVectorizer::merge_counts(std::vector<std::pair<uint32_t, uint32_t>>& a,
+                                   const std::vector<std::pair<uint32_t, uint32_t>>& b)
 {
-    std::vector<std::map<std::string, int>> documents_word_counts;
-    std::string word;
-    std::set<std::string> words_set;
-    for (size_t d = 0; d < documents_tokenised.size(); d++) // d: document index.
+    std::vector<std::pair<uint32_t, uint32_t>> merged;
+    merged.reserve(a.size() + b.size());
+    size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size())
     {
-        std::map<std::string, int> wc;
-        documents_word_counts.push_back(wc);
-        for (size_t w = 0; w < documents_tokenised[d].size(); w++) // w: word index.
+        if (j == b.size() || (i < a.size() && a[i].first < b[j].first))
+            merged.push_back(a[i++]);
+        else if (i == a.size() || b[j].first < a[i].first)
+            merged.push_back(b[j++]);
+        else
         {
-            word = documents_tokenised[d][w];
-            documents_word_counts[d][word] += 1;
-            words_set.insert(word);
+            merged.push_back({ a[i].first, a[i].second + b[j].second });
+            i++;
+            j++;
         }
     }
+    a.swap(merged);
+}
 
-    size_t i = 0;
-    for (std::set<std::string>::iterator it = words_set.begin(); it != words_set.end(); ++it)
+// Count the documents in [begin, end) that each word occurs in, as (word, count) sorted by word. The
+// distinct words of the documents are buffered and folded into counts a batch at a time, so memory
+// stays proportional to the vocabulary rather than to the number of documents.
+template <unsigned int N>
+void TfIdfVectorizer::count_documents(const DocumentReader& document, size_t begin, size_t end,
+                                      std::vector<std::pair<uint32_t, uint32_t>>& counts) const
+{
+    const size_t batch_size = 1 << 20;
+    std::vector<uint32_t> codes, batch;
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
+    counts.clear();
+    for (size_t d = begin; d < end; d++)
     {
-        word = *it;
-        this->vocabulary_[word] = i;
-        i++;
+        tokenise_document<N>(document(d), codes);
+        std::sort(codes.begin(), codes.end());
+        batch.insert(batch.end(), codes.begin(), std::unique(codes.begin(), codes.end()));
+        if (batch.size() < batch_size && d + 1 < end)
+            continue;
+
+        std::sort(batch.begin(), batch.end());
+        runs.clear();
+        for (size_t i = 0, j; i < batch.size(); i = j)
+        {
+            for (j = i + 1; j < batch.size() && batch[j] == batch[i]; j++)
+                ;
+            runs.push_back({ batch[i], (uint32_t)(j - i) });
+        }
+        merge_counts(counts, runs);
+        batch.clear();
     }
-    
-    return documents_word_counts;
 }
 
-void TfIdfVectorizer::fit(std::vector<std::string>& documents)
+void TfIdfVectorizer::fit(const std::vector<std::string>& documents, unsigned int num_threads)
+{
+    fit(documents.size(), [&documents](size_t d) { return std::string_view(documents[d]); }, num_threads);
+}
+
+void TfIdfVectorizer::fit(size_t num_documents, const DocumentReader& document, unsigned int num_threads)
 {
     this->vocabulary_.clear();
     this->idf_.clear();
-    std::vector<std::vector<std::string>> documents_tokenised = tokenise_documents(documents);
-    std::vector<std::map<std::string, int>> documents_word_counts = word_count(documents_tokenised);
-    idf(documents_word_counts);
-}
-
-std::map<std::string, double> TfIdfVectorizer::idf(std::vector<std::map<std::string, int>>& documents_word_counts)
-{
-    std::string key;
-    int value;
-    size_t i;
-    size_t documents = documents_word_counts.size();
-    double d_documents = (double)documents;
-    double temp_idf;
-    std::unordered_map<std::string, int> doc_freq;
-    
-    for(auto doc : documents_word_counts)
-        for(auto iter = doc.begin(); iter != doc.end(); ++iter) {
-            std::string key = iter->first;
-            auto d = doc_freq.find(key);
-            if (d != doc_freq.end())
-                doc_freq[key] = d->second+1;
-            else
-                doc_freq.insert({key, 1});
-        }
-    
-    for (auto it = this->vocabulary_.cbegin(); it != this->vocabulary_.cend(); ++it)
+
+    // Each thread counts the document frequencies of a shard of the documents, then the shards are merged
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> shards(std::max(num_threads, 1u));
+    size_t num_shards = 0;
+    specialise([&](auto n, auto norm) {
+        num_shards = run_shards(num_documents, num_threads, [&](size_t s, size_t begin, size_t end) {
+            count_documents<decltype(n)::value>(document, begin, end, shards[s]);
+        });
+    });
+    for (size_t s = 1; s < num_shards; s++)
+    {
+        merge_counts(shards[0], shards[s]);
+        std::vector<std::pair<uint32_t, uint32_t>>().swap(shards[s]);
+    }
+
+    double d_documents = (double)num_documents;
+    for (auto& it : shards[0])
     {
-        key = (*it).first;
-        value = doc_freq[key];
+        int value = it.second;
+        this->vocabulary_.push_back(it.first);
         /*Adding both denominator and numerator by 1 to avoid division by 0 AND negative idf */
-        temp_idf = std::log((d_documents + 1) / (value + 1)) + 1; //log+1 avoids terms with zero idf to be suppressed.
-        this->idf_[key] = temp_idf;
+        this->idf_.push_back(std::log((d_documents + 1) / (value + 1)) + 1); //log+1 avoids terms with zero idf to be suppressed.
     }
+
     /*Get only the words with highest idf.*/
-    if (this->max_features > 0)
+    if (this->max_features > 0 && this->vocabulary_.size() > (size_t)this->max_features)
+    {
+        std::vector<size_t> order(this->vocabulary_.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+            return this->idf_[a] > this->idf_[b];
+        });
+        order.resize(this->max_features);
+        std::sort(order.begin(), order.end());
+
+        std::vector<uint32_t> vocabulary;
+        std::vector<double> idf;
+        for (auto i : order)
+        {
+            vocabulary.push_back(this->vocabulary_[i]);
+            idf.push_back(this->idf_[i]);
+        }
+        this->vocabulary_.swap(vocabulary);
+        this->idf_.swap(idf);
+    }
+    compute_fingerprint();
+}
+
+// FNV-1a over the words and the bits of their idf, with the settings that change the vectors
+void TfIdfVectorizer::compute_fingerprint()
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto add = [&hash](const void *data, size_t size) {
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ ((const uint8_t *)data)[i]) * 0x100000001b3ull;
+    };
+    add(this->vocabulary_.data(), this->vocabulary_.size() * sizeof(uint32_t));
+    add(this->idf_.data(), this->idf_.size() * sizeof(double));
+    bool flags[] = { this->binary, this->lowercase, this->use_idf, this->sublinear_tf };
+    add(flags, sizeof(flags));
+    add(&this->p, sizeof(this->p));
+    add(&this->ngram_size, sizeof(this->ngram_size));
+    this->fingerprint_ = hash;
+}
+
+arma::sp_mat TfIdfVectorizer::fit_transform(const std::vector<std::string>& documents, unsigned int num_threads)
+{
+    fit(documents, num_threads);
+    return transform(documents, num_threads);
+}
+
+// Append the nonzero values of the documents in [begin, end) to rows/cols/values, column by column
+// in ascending row order
+template <unsigned int N, class Norm>
+void TfIdfVectorizer::transform_documents(const std::vector<std::string>& documents, size_t begin, size_t end,
+                                          std::vector<arma::uword>& rows, std::vector<arma::uword>& cols,
+                                          std::vector<double>& values) const
+{
+    std::vector<uint32_t> codes;
+    std::vector<std::pair<size_t, double>> features;
+    for (size_t d = begin; d < end; d++)
     {
-        /*Ordered set, reversed order by value*/
-        std::set<std::pair<int, std::string>> temp_idf;
-        for (auto const& x : this->idf_)
+        tokenise_document<N>(documents[d], codes);
+        size_t num_tokens = codes.size();
+        std::sort(codes.begin(), codes.end());
+
+        features.clear();
+        for (size_t i = 0, j; i < codes.size(); i = j)
         {
-            std::pair<int, std::string> elem (x.second, x.first);
-            temp_idf.insert(elem);
+            for (j = i + 1; j < codes.size() && codes[j] == codes[i]; j++)
+                ;
+            size_t w = feature(codes[i]);
+            if (w == this->vocabulary_.size())
+                continue;
+
+            double tf;
+            if (this->binary) // If True, all non-zero term counts are set to 1.
+                tf = 1;
+            else // Computes tf dividing term count by doc size.
+            {
+                tf = (double)(j - i) / num_tokens;
+                if (this->sublinear_tf)
+                    tf = 1 + std::log(tf);
+            }
+            double value = this->use_idf ? tf * this->idf_[w] : ((tf > 0) ? 1 : 0);
+            if (value != 0)
+                features.push_back({ w, value });
         }
 
-        /*Get the most important words from the ordered set */
-        this->idf_.clear();
-        this->vocabulary_.clear();
-        int i = 0;
-        std::set<std::pair<int, std::string>>::reverse_iterator rit;
-        for (rit = temp_idf.rbegin(); rit != temp_idf.rend(); rit++)
+        /*Normalize vector, summing up in the same order as transform_query.*/
         {
-            if (i == this->max_features)
-                break; 
-            this->idf_[rit->second] = rit->first;
-            this->vocabulary_[rit->second] = i;
-            i++;
+            double sum = 0;
+            for (auto& f : features)
+                sum = Norm::add(sum, f.second);
+            double norm_col = Norm::finish(sum);
+            if (norm_col != 0)
+                for (auto& f : features)
+                    f.second /= norm_col;
+        }
+
+        for (auto& f : features)
+        {
+            rows.push_back(f.first);
+            cols.push_back(d);
+            values.push_back(f.second);
         }
     }
-    return this->idf_;
-} 
+}
 
-std::vector<std::map<std::string, double>> TfIdfVectorizer::tf(std::vector<std::vector<std::string>>& documents_tokenised)
+arma::sp_mat TfIdfVectorizer::transform(const std::vector<std::string>& documents, unsigned int num_threads) const
 {
-    std::vector<std::map<std::string, double>> documents_word_frequency;
-    std::string word;
-    for (size_t d = 0; d < documents_tokenised.size(); d++) // d: document index.
+    // Every thread vectorises a shard of the documents, and the shards are put together in order
+    std::vector<std::vector<arma::uword>> rows(std::max(num_threads, 1u)), cols(rows.size());
+    std::vector<std::vector<double>> values(rows.size());
+    size_t num_shards = 0;
+    specialise([&](auto n, auto norm) {
+        num_shards = run_shards(documents.size(), num_threads, [&](size_t s, size_t begin, size_t end) {
+            transform_documents<decltype(n)::value, decltype(norm)>(documents, begin, end, rows[s], cols[s], values[s]);
+        });
+    });
+
+    size_t num_values = 0;
+    for (auto& it : values)
+        num_values += it.size();
+    arma::umat locations(2, num_values);
+    arma::vec x(num_values);
+    for (size_t s = 0, i = 0; s < num_shards; s++)
     {
-        std::map<std::string, double> wf;
-        documents_word_frequency.push_back(wf);
-        for (size_t w = 0; w < documents_tokenised[d].size(); w++) // w: word index.
+        for (size_t v = 0; v < values[s].size(); v++, i++)
         {
-            word = documents_tokenised[d][w];
-            documents_word_frequency[d][word] += 1;
+            locations(0, i) = rows[s][v];
+            locations(1, i) = cols[s][v];
+            x(i) = values[s][v];
         }
-        for (auto& s : documents_word_frequency[d])
+        std::vector<arma::uword>().swap(rows[s]);
+        std::vector<arma::uword>().swap(cols[s]);
+        std::vector<double>().swap(values[s]);
+    }
+    return arma::sp_mat(locations, x, this->vocabulary_.size(), documents.size(), false);
+}
+
+void TfIdfVectorizer::transform_postings(size_t num_documents, const DocumentReader& document,
+                                         std::vector<unsigned int>& offsets, std::vector<unsigned int>& ids,
+                                         std::vector<float>& weights, unsigned int num_threads, double unknown_idf) const
+{
+    specialise([&](auto n, auto norm) {
+        constexpr unsigned int N = decltype(n)::value;
+        using Norm = decltype(norm);
+
+        // First pass: count the postings of every term in each shard. Those counts then become the position
+        // at which the shard starts writing each term, so the second pass can fill all lists in place.
+        size_t num_terms = this->vocabulary_.size();
+        std::vector<std::vector<unsigned int>> cursors(std::max(num_threads, 1u));
+        size_t num_shards = run_shards(num_documents, num_threads, [&](size_t s, size_t begin, size_t end) {
+            std::vector<std::pair<size_t, double>> features;
+            cursors[s].assign(num_terms, 0);
+            for (size_t d = begin; d < end; d++)
+            {
+                vectorise<N, Norm>(document(d), features, unknown_idf);
+                for (auto& f : features)
+                    cursors[s][f.first]++;
+            }
+        });
+
+        offsets.assign(num_terms + 1, 0);
+        for (size_t t = 0; t < num_terms; t++)
         {
-            if(this->binary) // If True, all non-zero term counts are set to 1. 
-                documents_word_frequency[d][s.first] = (documents_word_frequency[d][s.first] > 0) ? 1 : 0;
-            else // Computes tf dividing term count by doc size.
+            unsigned int pos = offsets[t];
+            for (size_t s = 0; s < num_shards; s++)
+            {
+                unsigned int count = cursors[s][t];
+                cursors[s][t] = pos;
+                pos += count;
+            }
+            offsets[t + 1] = pos;
+        }
+
+        // Second pass: shards hold consecutive documents, so every posting list comes out sorted by document
+        ids.resize(offsets[num_terms]);
+        weights.resize(offsets[num_terms]);
+        run_shards(num_documents, num_threads, [&](size_t s, size_t begin, size_t end) {
+            std::vector<std::pair<size_t, double>> features;
+            for (size_t d = begin; d < end; d++)
             {
-                documents_word_frequency[d][s.first] /= documents_tokenised[d].size();
-                if(this->sublinear_tf)
-                    documents_word_frequency[d][s.first] = 1 + std::log(documents_word_frequency[d][s.first]);
+                vectorise<N, Norm>(document(d), features, unknown_idf);
+                for (auto& f : features)
+                {
+                    unsigned int pos = cursors[s][f.first]++;
+                    ids[pos] = d;
+                    weights[pos] = f.second;
+                }
             }
-        } 
+        });
+    });
+}
+
+void TfIdfVectorizer::transform_query(std::string_view document, std::vector<std::pair<size_t, double>>& features,
+                                      double unknown_idf) const
+{
+    specialise([&](auto n, auto norm) {
+        vectorise<decltype(n)::value, decltype(norm)>(document, features, unknown_idf);
+    });
+}
+
+template <unsigned int N, class Norm>
+void TfIdfVectorizer::vectorise(std::string_view document, std::vector<std::pair<size_t, double>>& features,
+                                double unknown_idf) const
+{
+    features.clear();
+    double unknown_sum = 0;
+
+    // Same words as tokenise_document
+    char padded[N];
+    document = pad_document<N>(document, padded);
+    size_t num_tokens = document.length() - N + 1;
+
+    for (size_t i = 0; i < num_tokens; i++)
+    {
+        uint32_t code = ngram_code<N>(document, i);
+
+        // Count each word at its first occurrence only
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; j++)
+            seen = ngram_code<N>(document, j) == code;
+        if (seen)
+            continue;
+
+        size_t w = feature(code);
+        if (w == this->vocabulary_.size() && unknown_idf == 0)
+            continue;
+
+        uint32_t count = 1;
+        for (size_t j = i + 1; j < num_tokens; j++)
+            if (ngram_code<N>(document, j) == code)
+                count++;
+        add_word<Norm>(w, count, num_tokens, unknown_idf, features, unknown_sum);
     }
-    return documents_word_frequency;
+    normalise<Norm>(features, unknown_sum);
 }
 
-arma::sp_mat TfIdfVectorizer::fit_transform(std::vector<std::string>& documents)
+// Append the weight of word w, which occurs count times among num_tokens, to features, or add it to unknown_sum
+// if w isn't in the vocabulary
+template <class Norm>
+void TfIdfVectorizer::add_word(size_t w, uint32_t count, size_t num_tokens, double unknown_idf,
+                               std::vector<std::pair<size_t, double>>& features, double& unknown_sum) const
 {
-    fit(documents);
-    return transform(documents);
+    bool known = w != this->vocabulary_.size();
+    double tf;
+    if (this->binary)
+        tf = 1;
+    else
+    {
+        tf = (double)count / num_tokens;
+        if (this->sublinear_tf)
+            tf = 1 + std::log(tf);
+    }
+
+    double value;
+    if (this->use_idf)
+        value = tf * (known ? this->idf_[w] : unknown_idf);
+    else
+        value = (tf > 0) ? 1 : 0;
+    if (!known)
+        unknown_sum = Norm::add(unknown_sum, value);
+    else if (value != 0)
+        features.push_back({ w, value });
 }
 
-arma::sp_mat TfIdfVectorizer::transform(std::vector<std::string>& documents)
+// Sort features and scale them to unit norm, counting in the words outside the vocabulary
+template <class Norm>
+void TfIdfVectorizer::normalise(std::vector<std::pair<size_t, double>>& features, double unknown_sum) const
 {
-    std::vector<std::vector<std::string>> documents_tokenised = tokenise_documents(documents);
-    std::vector<std::map<std::string, double>> documents_word_counts = tf(documents_tokenised);
-    arma::sp_mat X_transformed(this->vocabulary_.size(), documents.size());
+    std::sort(features.begin(), features.end());
 
-    std::map<std::string, double> tf_hash;
-    std::string word;
-    size_t w;
-    double idf;
-    int zero = 0;
-    int nonzero = 0;
-    for (size_t d = 0; d < documents.size(); d++)
+    /*Normalize vector.*/
+    double sum = 0;
+    for (auto& f : features)
+        sum = Norm::add(sum, f.second);
+    if (unknown_sum != 0)
+        sum += unknown_sum;
+    double norm_col = Norm::finish(sum);
+    if (norm_col != 0)
+        for (auto& f : features)
+            f.second /= norm_col;
+}
+
+template <unsigned int N>
+static void count_ngrams(std::string_view document, DocumentWords& words)
+{
+    char padded[N];
+    document = pad_document<N>(document, padded);
+    words.num_tokens = document.length() - N + 1;
+    words.words.clear();
+    for (size_t i = 0; i < words.num_tokens; i++)
     {
-        tf_hash = documents_word_counts[d];
-        for (auto & itr : tf_hash)
-        {
-            word = itr.first;
-            w = this->vocabulary_[word];
-            idf = this->idf_[word];
-            if (itr.second > 0)
-                nonzero++;
-            else
-                zero++;
-            if (this->use_idf) {
-                X_transformed(w, d) = itr.second * idf;
-            }
-            else
-                X_transformed(w, d) = (tf_hash[word] > 0) ? 1 : 0;
-        }
+        uint32_t code = ngram_code<N>(document, i);
+        auto it = std::find_if(words.words.begin(), words.words.end(), [code](const std::pair<uint32_t, uint32_t>& word) {
+            return word.first == code;
+        });
+        if (it != words.words.end())
+            it->second++;
+        else
+            words.words.push_back({ code, 1 });
     }
+}
 
-    /*Normalize vectors.*/
-    if (this->p != 0)
+void TfIdfVectorizer::count_words(std::string_view document, unsigned int ngram_size, DocumentWords& words)
+{
+    words.ngram_size = ngram_size;
+    switch (ngram_size)
     {
-        for (size_t i = 0; i < X_transformed.n_cols; ++i) {
-            double norm_col = norm(X_transformed.col(i), 2);
-            if (norm_col != 0) {
-                X_transformed.col(i) /= norm_col;
-            }
-        }
+        case 1: count_ngrams<1>(document, words); break;
+        case 2: count_ngrams<2>(document, words); break;
+        case 3: count_ngrams<3>(document, words); break;
+        default: words.ngram_size = 4; count_ngrams<4>(document, words); break;
     }
-    return X_transformed;
 }
 
-std::map<std::string, double> TfIdfVectorizer::get_idf_()
+void TfIdfVectorizer::transform_words(const DocumentWords& words, std::vector<std::pair<size_t, double>>& features,
+                                      double unknown_idf) const
+{
+    specialise([&](auto n, auto norm) {
+        using Norm = decltype(norm);
+        double unknown_sum = 0;
+        features.clear();
+        for (auto& word : words.words)
+        {
+            size_t w = feature(word.first);
+            if (w == this->vocabulary_.size() && unknown_idf == 0)
+                continue;
+            add_word<Norm>(w, word.second, words.num_tokens, unknown_idf, features, unknown_sum);
+        }
+        normalise<Norm>(features, unknown_sum);
+    });
+}
+
+double TfIdfVectorizer::max_idf() const
+{
+    double max_idf = 0;
+    for (auto idf : this->idf_)
+        max_idf = std::max(max_idf, idf);
+    return max_idf;
+}
+
+static std::string ngram_string(uint32_t code, unsigned int ngram_size)
 {
-    const std::map<std::string, double> i = this->idf_;
+    std::string word;
+    for (unsigned int k = ngram_size; k-- > 0;)
+        word += (char)(code >> (8 * k));
+    return word;
+}
+
+std::map<std::string, double> TfIdfVectorizer::get_idf_() const
+{
+    std::map<std::string, double> i;
+    for (size_t w = 0; w < this->vocabulary_.size(); w++)
+        i[ngram_string(this->vocabulary_[w], this->ngram_size)] = this->idf_[w];
     return i;
 }
 
-std::map<std::string, size_t> TfIdfVectorizer::get_vocabulary_()
+std::map<std::string, size_t> TfIdfVectorizer::get_vocabulary_() const
 {
-    const std::map<std::string, size_t> v = this->vocabulary_;
+    std::map<std::string, size_t> v;
+    for (size_t w = 0; w < this->vocabulary_.size(); w++)
+        v[ngram_string(this->vocabulary_[w], this->ngram_size)] = w;
     return v;
-}
\ No newline at end of file
+}
@@ -14,19 +14,33 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <functional>
 #include <armadillo>
 #include <map>
 #include <cmath>
-#include <set>
+#include <stdint.h>
+#include <stdexcept>
 
 #include <cereal/archives/binary.hpp>
-#include <cereal/types/map.hpp>
-#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+// The distinct words of a document in order of first occurrence, with the number of times each occurs.
+// Counting them only depends on the n-gram size, so one count serves any vocabulary.
+struct DocumentWords
+{
+    unsigned int ngram_size = 0;
+    size_t num_tokens = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> words;
+};
 
 class TfIdfVectorizer
 {
     public:
+        // Reads document i, for vectorising documents that are not held as strings
+        using DocumentReader = std::function<std::string_view(size_t)>;
+
         /**
          * Constructor.
          * 
@@ -43,63 +57,179 @@ class TfIdfVectorizer
          *              ‘l2’: Sum of squares of vector elements is 1.
          *              ‘l1’: Sum of absolute values of vector elements is 1. 
          * @param sublinear_tf: Apply sublinear tf scaling, i.e. replace tf with 1 + log(tf).
+         * @param ngram_size: the number of characters in a word, from 1 to MAX_NGRAM_SIZE. Documents
+         *                    shorter than that are padded with spaces to a single word.
          */
-        TfIdfVectorizer(bool binary=false, bool lowercase=true, bool use_idf=true, int max_features=-1, std::string norm="l2", bool sublinear_tf=false);
+        TfIdfVectorizer(bool binary=false, bool lowercase=true, bool use_idf=true, int max_features=-1, std::string norm="l2", bool sublinear_tf=false,
+                        unsigned int ngram_size=3);
+
+        // Words are packed into 32 bit codes
+        static const unsigned int MAX_NGRAM_SIZE = 4;
 
         /**
          * Fit the model by computing idf of training data.
          * 
          * @param documents: a list of strings. Each string is a document (raw text).
+         * @param num_threads: the number of threads that count document frequencies.
          */
-        void fit(std::vector<std::string>& documents);
+        void fit(const std::vector<std::string>& documents, unsigned int num_threads = 1);
 
         /**
-         * Convert raw documents to a binary/tfidf representation.
+         * Fit the model in a single pass over documents that are read one at a time. Memory use
+         * follows the size of the vocabulary, not the number of documents.
+         *
+         * @param num_documents: the number of documents.
+         * @param document: returns the raw text of a document. It is called from num_threads threads at once.
+         * @param num_threads: the number of threads that count document frequencies.
+         */
+        void fit(size_t num_documents, const DocumentReader& document, unsigned int num_threads = 1);
+
+        /**
+         * Convert raw documents to a binary/tfidf representation. Words that are not in the vocabulary
+         * are dropped; the vocabulary only ever changes in fit.
          * 
          * @param documents: a list of strings. Each string is a document (raw text).
+         * @param num_threads: the number of threads that vectorise the documents.
          * 
          * @return matrix with numerical features. 
          *         Each row is a feature. 
          *         Each column is a document.
          */
-        arma::sp_mat transform(std::vector<std::string>& documents);
+        arma::sp_mat transform(const std::vector<std::string>& documents, unsigned int num_threads = 1) const;
 
         /**
          * Fit, followed by transform over the same argument.
          * 
          * @param documents: a list of strings. Each string is a document (raw text).
+         * @param num_threads: the number of threads for both steps.
          * 
          * @return matrix with numerical features. 
          *         Each row is a feature. 
          *         Each column is a document.
          */
-        arma::sp_mat fit_transform(std::vector<std::string>& documents);
+        arma::sp_mat fit_transform(const std::vector<std::string>& documents, unsigned int num_threads = 1);
+
+        /**
+         * Vectorise documents straight into an inverted index: the documents that contain feature t are
+         * ids[offsets[t], offsets[t + 1]) in ascending order, with their weights in the same range of
+         * weights. The documents are read twice, once to size the posting lists and once to fill them,
+         * so nothing but the postings themselves grows with the number of documents. Each document is
+         * vectorised as by transform_query, so the documents are expected to be short.
+         *
+         * @param num_documents: the number of documents.
+         * @param document: returns the raw text of a document. It is called from num_threads threads at once.
+         * @param num_threads: the number of threads that vectorise the documents.
+         * @param unknown_idf: as for transform_query.
+         */
+        void transform_postings(size_t num_documents, const DocumentReader& document,
+                                std::vector<unsigned int>& offsets, std::vector<unsigned int>& ids,
+                                std::vector<float>& weights, unsigned int num_threads = 1,
+                                double unknown_idf = 0.0) const;
+
+        /**
+         * Convert a single document into (feature, weight) pairs, ordered by feature. Words that are not
+         * in the vocabulary are dropped. Unlike transform, this neither allocates (once features has
+         * grown to fit) nor modifies the vectorizer, so it is safe to call from many threads at once.
+         * The document is expected to be short, since repeated words are counted in quadratic time.
+         *
+         * @param document: the raw text of the document.
+         * @param features: receives the (feature, weight) pairs.
+         * @param unknown_idf: if not 0, words that are not in the vocabulary still count towards the norm,
+         *                     with this idf.
+         */
+        void transform_query(std::string_view document, std::vector<std::pair<size_t, double>>& features,
+                             double unknown_idf = 0.0) const;
+
+        /**
+         * Count the words of a document for transform_words.
+         *
+         * @param document: the raw text of the document.
+         * @param ngram_size: the n-gram size of the vectorizers the words are for.
+         * @param words: receives the words.
+         */
+        static void count_words(std::string_view document, unsigned int ngram_size, DocumentWords& words);
 
-        std::map<std::string, double> get_idf_();
-        std::map<std::string, size_t> get_vocabulary_();
+        /**
+         * The same as transform_query on the document that words were counted from, which must have been
+         * counted with this vectorizer's n-gram size. Saves counting the words again when a document is
+         * vectorised by many vectorizers.
+         */
+        void transform_words(const DocumentWords& words, std::vector<std::pair<size_t, double>>& features,
+                             double unknown_idf = 0.0) const;
+
+        /**
+         * The largest idf in the vocabulary, which is the idf of a word that occurs in a single document.
+         */
+        double max_idf() const;
+
+        unsigned int get_ngram_size() const { return ngram_size; }
+
+        size_t num_features() const { return vocabulary_.size(); }
+
+        /**
+         * A hash of the vocabulary and idf, which tells vectorizers fitted to different documents apart.
+         */
+        uint64_t fingerprint() const { return fingerprint_; }
+
+        std::map<std::string, double> get_idf_() const;
+        std::map<std::string, size_t> get_vocabulary_() const;
         
         template<class Archive>
-        void serialize(Archive & archive)
+        void save(Archive & archive) const
+        {
+            archive( vocabulary_, idf_, binary, max_features, p, lowercase, use_idf, sublinear_tf, ngram_size );
+        }
+
+        template<class Archive>
+        void load(Archive & archive)
         {
-            archive( idf_, vocabulary_, binary, max_features, p, lowercase, use_idf, sublinear_tf );
+            archive( vocabulary_, idf_, binary, max_features, p, lowercase, use_idf, sublinear_tf, ngram_size );
+            if (ngram_size < 1 || ngram_size > MAX_NGRAM_SIZE)
+                throw std::runtime_error("invalid n-gram size");
+            compute_fingerprint();
         }
         
     protected:
-        std::vector<std::string> tokenise_document(std::string& document);
-        std::vector<std::vector<std::string>> tokenise_documents(std::vector<std::string>& documents);
-        std::vector<std::map<std::string, int>> word_count(std::vector<std::vector<std::string>>& documents_tokenised);
-        std::vector<std::map<std::string, double>> tf(std::vector<std::vector<std::string>>& documents_tokenised);
-        std::map<std::string, double> idf(std::vector<std::map<std::string, int>>& documents_word_counts);
+        // The loops below are compiled once for every n-gram size N and normalisation Norm, and the public
+        // functions pick the copy that matches the vectorizer
+        template <unsigned int N>
+        void tokenise_document(std::string_view document, std::vector<uint32_t>& codes) const;
+        template <unsigned int N>
+        void count_documents(const DocumentReader& document, size_t begin, size_t end,
+                             std::vector<std::pair<uint32_t, uint32_t>>& counts) const;
+        template <unsigned int N, class Norm>
+        void transform_documents(const std::vector<std::string>& documents, size_t begin, size_t end,
+                                 std::vector<arma::uword>& rows, std::vector<arma::uword>& cols,
+                                 std::vector<double>& values) const;
+        template <unsigned int N, class Norm>
+        void vectorise(std::string_view document, std::vector<std::pair<size_t, double>>& features,
+                       double unknown_idf) const;
+        template <class Norm>
+        void add_word(size_t w, uint32_t count, size_t num_tokens, double unknown_idf,
+                      std::vector<std::pair<size_t, double>>& features, double& unknown_sum) const;
+        template <class Norm>
+        void normalise(std::vector<std::pair<size_t, double>>& features, double unknown_sum) const;
+        template <typename Work>
+        void specialise(Work work) const;
+
+        size_t feature(uint32_t code) const;
+        void compute_fingerprint();
+        static void merge_counts(std::vector<std::pair<uint32_t, uint32_t>>& a,
+                                 const std::vector<std::pair<uint32_t, uint32_t>>& b);
 
     private:
-        std::map<std::string, double> idf_;
-        std::map<std::string, size_t> vocabulary_;
+        // The codes of the vocabulary in ascending order, with the idf of each. The feature number of a
+        // word is its position in vocabulary_.
+        std::vector<uint32_t> vocabulary_;
+        std::vector<double> idf_;
         bool binary;
         int max_features;
         double p;
         bool lowercase;
         bool use_idf;
         bool sublinear_tf;
+        unsigned int ngram_size;
+        uint64_t fingerprint_;
 };
 
 #endif
\ No newline at end of file
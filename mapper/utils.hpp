@@ -1,6 +1,7 @@
 #pragma once
 #include <stdio.h>
 #include <stdarg.h>
+#include <ctime>
 #include <fstream>
 #include <string>
 #include <cstdlib>